@@ -6,10 +6,14 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <cstdint>
+#include <cstdlib>
 #include <filesystem>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <optional>
 #include <ranges>
+#include <set>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -18,7 +22,7 @@
 
 class image_viewer {
   private:
-	GLFWwindow *window, *load_window;
+	GLFWwindow *window;
 	glm::ivec2 window_size;
 
 	GLuint null_vaoID;
@@ -27,19 +31,21 @@ class image_viewer {
 
 	texture_load_pool loader_pool;
 	// key for following maps is texture_key(image_index, texture)
-	std::unordered_map<int64_t, lazy_load<GLuint>> textures;
+	std::unordered_map<int64_t, texture_handle> textures;
 	std::unordered_map<int64_t, bool> texture_used;
 
 	// images vectors
 	std::vector<std::string> image_paths;
-	std::vector<lazy_load<glm::ivec2>> image_sizes;
-	std::vector<lazy_load<int>> image_types;
+	std::vector<std::optional<glm::ivec2>> image_sizes;
+	std::vector<std::optional<int>> image_types;
+	std::vector<bool> size_type_requested;
 	std::vector<bool> image_removed;
 	std::vector<bool> paging_invert;
 
 	// tags maps
 	std::map<int, std::vector<int>>
 		tags_indices; // tag -> vector of indices pointing to image vectors
+	std::set<int> classified_tags; // tags tag_classified was printed for
 
 	struct image_pos {
 		int tag = -1;
@@ -48,12 +54,18 @@ class image_viewer {
 	} curr_image_pos;
 
 	std::vector<int> last_image_indices;
+	// position of each image across all tags in reading order, -1 if removed
+	std::vector<int> image_order;
+	int reading_dir = 1;
 
 	enum class view_mode { manga, single, vertical } curr_view_mode;
 	float vertical_offset = 0.f;
 
 	int pressed_key;
 	double time_pressed_key = 0.0;
+
+	double stats_interval = 0.0; // seconds, 0 if stats aren't printed
+	double last_stats_time = 0.0;
 	double repeat_wait = 0.0;
 
 	void init_window() {
@@ -68,9 +80,6 @@ class image_viewer {
 		window =
 			glfwCreateWindow(800, 600, "image viewer", nullptr, nullptr);
 
-		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
-		load_window = glfwCreateWindow(1, 1, "load window", nullptr, window);
-
 		if (!window) {
 			fprintf(stderr, "ERROR: could not open window with GLFW3\n");
 			glfwTerminate();
@@ -148,7 +157,15 @@ void main()
 		glTextureSubImage2D(white_tex, 0, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE,
 							white_pixel);
 
-		loader_pool.init(load_window, std::thread::hardware_concurrency() - 1);
+		unsigned int cores = std::max(std::thread::hardware_concurrency(), 2u);
+		// IMAGE_VIEWER_UPLOAD_CONTEXTS=n uploads from n threads at once
+		unsigned int upload_contexts = 1;
+		if (const char *n = std::getenv("IMAGE_VIEWER_UPLOAD_CONTEXTS"))
+			upload_contexts = std::max(std::atoi(n), 1);
+		loader_pool.init(window, {.read_threads = 1,
+								  .decode_threads = cores - 1,
+								  .resize_threads = cores - 1,
+								  .upload_contexts = upload_contexts});
 	}
 
 	void on_resize(int width, int height) {
@@ -300,33 +317,77 @@ void main()
 		return true;
 	}
 
-	void preload_close_image_types() {
+	void request_size_type(int image_index) {
+		if (size_type_requested[image_index])
+			return;
+		size_type_requested[image_index] = true;
+		loader_pool.get_size_type(image_index, image_paths[image_index],
+								  load_priority(image_index, true));
+	}
+
+	// types of all images of the current tag and the ones next to it, so
+	// manga pairing settles for the whole chapter. Like all size/type
+	// requests these come after every texture load, closest pages first.
+	// Only manga mode pairs pages, the others don't need the decodes
+	void classify_close_tags() {
 		auto tag_it = tags_indices.find(curr_image_pos.tag);
 		if (tag_it == tags_indices.end() || curr_view_mode != view_mode::manga)
 			return;
 
-		image_pos pos = curr_image_pos;
-		for (int i = 0; i < 10; i++) {
-			pos.tag_index += 1;
-			if (pos.tag_index == tag_it->second.size()) {
-				std::advance(tag_it, 1);
-				if (tag_it == tags_indices.end())
-					return;
-
-				pos = {tag_it->first, 0};
-			}
+		std::vector<int> close_tags = {tag_it->first};
+		if (std::next(tag_it) != tags_indices.end())
+			close_tags.push_back(std::next(tag_it)->first);
+		if (tag_it != tags_indices.begin())
+			close_tags.push_back(std::prev(tag_it)->first);
 
-			int image_index = tags_indices[pos.tag][pos.tag_index];
-			if (!image_types[image_index].has_value())
-				std::tie(image_sizes[image_index], image_types[image_index]) =
-					loader_pool.get_size_type(image_paths[image_index]);
+		for (int tag : close_tags) {
+			if (classified_tags.contains(tag))
+				continue;
+			bool classified = true;
+			for (int image_index : tags_indices[tag]) {
+				request_size_type(image_index);
+				classified = classified && image_types[image_index];
+			}
+			if (classified) {
+				classified_tags.insert(tag);
+				std::cout << "tag_classified=" << tag << std::endl;
+			}
 		}
 	}
 
+	void update_image_order() {
+		image_order.assign(image_paths.size(), -1);
+		int order = 0;
+		for (const auto &[tag, indices] : tags_indices)
+			for (int image_index : indices)
+				image_order[image_index] = order++;
+	}
+
+	// visible images first, then the closest ones in reading direction, then
+	// size/type requests only needed for pagination
+	int load_priority(int image_index, bool size_request) {
+		if (std::find(last_image_indices.begin(), last_image_indices.end(),
+					  image_index) != last_image_indices.end())
+			return 0;
+		if (curr_image_pos.tag_index == -1 || image_order[image_index] == -1)
+			return std::numeric_limits<int>::max();
+
+		int curr_image_index =
+			tags_indices[curr_image_pos.tag][curr_image_pos.tag_index];
+		int dist = (image_order[image_index] - image_order[curr_image_index]) *
+				   reading_dir;
+		int rank = dist > 0 ? 2 * dist - 1 : -2 * dist;
+
+		if (size_request)
+			rank += 2 * image_paths.size();
+		return rank + 1;
+	}
+
 	bool advance_current_pos(int dir) {
 		if (curr_image_pos.tag_index == -1)
 			return false;
 
+		reading_dir = dir;
 		image_pos start_pos = curr_image_pos;
 		float start_vertical_offset = vertical_offset;
 
@@ -378,11 +439,11 @@ void main()
 	}
 
 	glm::ivec2 get_image_size(int image_index) {
-		return image_sizes[image_index].get_or({1000, 1414});
+		return image_sizes[image_index].value_or(glm::ivec2(1000, 1414));
 	}
 
 	int get_image_type(int image_index) {
-		return image_types[image_index].get_or(0);
+		return image_types[image_index].value_or(0);
 	}
 
 	int64_t texture_key(int image_index, glm::ivec2 size) const {
@@ -415,6 +476,8 @@ void main()
 			if (!tag_indices.empty() && tag == curr_image_pos.tag)
 				prev_curr_image_index = tag_indices[curr_image_pos.tag_index];
 
+			std::vector<std::pair<int, std::string>> unsized_images;
+
 			for (const auto &image_path : args | std::views::drop(1)) {
 				if (!std::filesystem::exists(image_path)) {
 					std::cerr << image_path << " not found" << std::endl;
@@ -432,6 +495,7 @@ void main()
 
 					image_sizes.emplace_back();
 					image_types.emplace_back();
+					size_type_requested.push_back(false);
 				} else if (image_removed[image_index])
 					image_removed[image_index] = false;
 				else {
@@ -440,7 +504,23 @@ void main()
 				}
 
 				tag_indices.push_back(image_index);
+				classified_tags.erase(tag);
+				if (image_sizes[image_index])
+					continue;
+				// known from an earlier run, so the layout is right at once
+				auto meta = loader_pool.cached_metadata(image_path);
+				if (!meta || meta->size.x == 0) {
+					unsized_images.emplace_back(image_index, image_path);
+					continue;
+				}
+				image_sizes[image_index] = meta->size;
+				if (meta->image_type != -1) {
+					image_types[image_index] = meta->image_type;
+					size_type_requested[image_index] = true;
+				}
 			}
+			// sizes are enough for the page layout, get them all now
+			loader_pool.probe_sizes(unsized_images);
 			if (tag_indices.empty()) {
 				tags_indices.erase(tag);
 				return;
@@ -463,6 +543,7 @@ void main()
 
 				curr_image_pos = {tag, correct_tag_index};
 			}
+			update_image_order();
 		} else if (type == "goto_tag" || type == "remove_tag") {
 			int tag = std::stoi(args[0]);
 			auto tag_it = tags_indices.find(tag);
@@ -493,6 +574,8 @@ void main()
 				image_removed[image_index] = true;
 
 			tags_indices.erase(tag_it);
+			classified_tags.erase(tag);
+			update_image_order();
 		} else if (type == "change_mode") {
 			std::string new_mode_str = args[0];
 			view_mode new_mode;
@@ -508,10 +591,30 @@ void main()
 				return;
 			}
 			change_mode(new_mode);
+		} else if (type == "live_textures")
+			std::cout << "live_textures=" << loader_pool.live_textures()
+					  << std::endl;
+		else if (type == "buffer_stats") {
+			auto &pool = buffer_pool::instance();
+			std::cout << "buffer_stats=allocations:" << pool.allocations
+					  << ",reuses:" << pool.reuses << ",maps:" << pool.maps
+					  << ",unmaps:" << pool.unmaps
+					  << ",mapped_bytes:" << pool.mapped_bytes
+					  << ",rss_bytes:" << read_rss_bytes() << std::endl;
+		} else if (type == "stats") {
+			// stats(interval in ms) also prints every interval, 0 stops
+			if (!args[0].empty())
+				stats_interval = std::stoi(args[0]) / 1000.0;
+			print_stats();
 		} else if (type == "quit")
 			glfwSetWindowShouldClose(window, true);
 	}
 
+	void print_stats() {
+		std::cout << "stats=" << loader_pool.stats() << std::endl;
+		last_stats_time = glfwGetTime();
+	}
+
 	void change_mode(view_mode new_mode) {
 		if (new_mode == curr_view_mode)
 			return;
@@ -558,6 +661,8 @@ void main()
 		if (curr_view_mode != view_mode::vertical)
 			return;
 
+		if (offset != 0)
+			reading_dir = offset < 0 ? 1 : -1;
 		image_pos start_pos = curr_image_pos;
 		float start_offset = vertical_offset;
 		vertical_offset += offset;
@@ -582,29 +687,29 @@ void main()
 		int64_t tex_key = texture_key(image_index, size);
 		texture_used[tex_key] = true;
 
-		if (!image_sizes[image_index].has_value())
-			std::tie(image_sizes[image_index], image_types[image_index]) =
-				loader_pool.get_size_type(image_paths[image_index]);
-
-		if (!image_sizes[image_index].ready())
+		request_size_type(image_index);
+		if (!image_sizes[image_index])
 			return white_tex;
 
-		if (!textures.contains(tex_key))
-			textures.try_emplace(tex_key, loader_pool.load_texture(
-											  image_paths[image_index], size));
-
-		GLuint tex = textures[tex_key].get_or(white_tex);
-		if (tex == white_tex) {
-			auto loaded_it = std::find_if(
-				textures.begin(), textures.end(), [image_index](auto &tex) {
-					return tex.first >> 32 == image_index && tex.second.ready();
-				});
-			if (loaded_it != textures.end()) {
-				texture_used[loaded_it->first] = true;
-				return loaded_it->second.get();
-			}
+		auto [tex_it, inserted] = textures.try_emplace(tex_key);
+		if (inserted)
+			tex_it->second =
+				loader_pool.load_texture(image_index, image_paths[image_index],
+										 size,
+										 load_priority(image_index, false));
+
+		if (tex_it->second.tex)
+			return tex_it->second.tex;
+
+		auto loaded_it = std::find_if(
+			textures.begin(), textures.end(), [image_index](auto &tex) {
+				return tex.first >> 32 == image_index && tex.second.tex;
+			});
+		if (loaded_it != textures.end()) {
+			texture_used[loaded_it->first] = true;
+			return loaded_it->second.tex;
 		}
-		return tex;
+		return white_tex;
 	}
 
 	std::vector<int> get_page_start_indices(const std::vector<int> &indices) {
@@ -780,10 +885,41 @@ void main()
 	}
 
 	void render() {
-		preload_close_image_types();
+		loader_pool.drain_completions([this](const load_completion &done) {
+			switch (done.kind) {
+			case completion_kind::image_size:
+				image_sizes[done.image_index] = done.size;
+				break;
+			case completion_kind::image_type:
+				image_types[done.image_index] = done.image_type;
+				break;
+			case completion_kind::texture:
+				textures[texture_key(done.image_index, done.size)].tex =
+					done.texture;
+				break;
+			}
+		});
 		auto current_render_data = get_current_render_data();
 
 		std::vector<int> current_image_indices;
+		for (auto [pos, size_offset] : current_render_data)
+			if (size_offset.z != 1000000) // not preload
+				current_image_indices.push_back(
+					tags_indices[pos.tag][pos.tag_index]);
+
+		if (current_image_indices != last_image_indices) {
+			std::cout << "current_image=";
+			for (auto index : current_image_indices)
+				std::cout << image_paths[index] << '\t';
+			std::cout << std::endl;
+
+			last_image_indices = current_image_indices;
+			loader_pool.reprioritize([this](int image_index, bool size_req) {
+				return load_priority(image_index, size_req);
+			});
+		}
+
+		classify_close_tags();
 		for (auto [pos, size_offset] : current_render_data) {
 			int image_index = tags_indices[pos.tag][pos.tag_index];
 			GLuint tex =
@@ -795,26 +931,17 @@ void main()
 			glProgramUniform2f(program.id(), 1, size_offset.z, size_offset.w);
 			glProgramUniform2f(program.id(), 2, size_offset.x, size_offset.y);
 			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-			current_image_indices.push_back(image_index);
 		}
 
 		for (auto &[key, used] : texture_used)
 			if (!used) {
-				glDeleteTextures(1, &textures[key].get_or(0));
+				loader_pool.release_texture(textures[key]);
 				textures.erase(key);
 			}
 		std::erase_if(texture_used,
 					  [](auto &pair) { return pair.second == false; });
 		for (auto &[key, used] : texture_used)
 			used = false;
-
-		if (current_image_indices != last_image_indices) {
-			std::cout << "current_image=";
-			for (auto index : current_image_indices)
-				std::cout << image_paths[index] << '\t';
-			std::cout << std::endl;
-		}
-		last_image_indices = current_image_indices;
 	}
 
   public:
@@ -842,6 +969,9 @@ void main()
 			glfwPollEvents();
 			handle_stdin();
 			handle_keys(dt);
+			if (stats_interval > 0.0 &&
+				last_t - last_stats_time >= stats_interval)
+				print_stats();
 
 			glClear(GL_COLOR_BUFFER_BIT);
 			if (i++ > 5)
@@ -855,12 +985,11 @@ void main()
 	~image_viewer() {
 		glDeleteTextures(1, &white_tex);
 		for (auto &[key, tex] : textures)
-			glDeleteTextures(1, &tex.get());
+			loader_pool.release_texture(tex);
 		glDeleteVertexArrays(1, &null_vaoID);
 		program.destroy();
 		loader_pool.destroy();
 
-		glfwDestroyWindow(load_window);
 		glfwDestroyWindow(window);
 		glfwTerminate();
 	}
@@ -0,0 +1,118 @@
+// replays the allocations of a reading session through malloc and through
+// buffer_pool: per page a file buffer, the decode, kept in a decode cache
+// of cache_mb, and the resized pixels. Each run is in its own process so
+// RSS and page faults are its own.
+//
+//   bench/buffer_pool [pages] [cache_mb]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <utility>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../buffer_pool.hpp"
+
+struct page {
+	size_t file_bytes, decode_bytes, resized_bytes;
+};
+
+std::vector<page> session(int pages) {
+	// mostly 2-8 MP chapter pages, some 35 MP archival scans
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int> width(1600, 2400), scan(0, 9);
+	std::vector<page> out;
+	for (int i = 0; i < pages; ++i) {
+		size_t w = scan(rng) == 0 ? 5000 : width(rng), h = w * 1414 / 1000;
+		out.push_back({w * h * 4 / 10, w * h * 4, size_t(1300) * 1838 * 4});
+	}
+	return out;
+}
+
+size_t rss_bytes() {
+	size_t pages = 0, resident = 0;
+	if (FILE *f = fopen("/proc/self/statm", "r")) {
+		if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// writes every page of the block, as reading, decoding or resizing does
+void touch(void *ptr, size_t bytes) { memset(ptr, 1, bytes); }
+
+template <typename Alloc, typename Free>
+void replay(const char *allocator, const std::vector<page> &pages,
+			size_t cache_bytes, Alloc &&alloc, Free &&free_block) {
+	std::deque<std::pair<void *, size_t>> cache;
+	size_t cached = 0, peak_rss = 0, min_rss = SIZE_MAX;
+	uint64_t allocations = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (const page &p : pages) {
+		void *file = alloc(p.file_bytes);
+		touch(file, p.file_bytes);
+		void *decode = alloc(p.decode_bytes);
+		touch(decode, p.decode_bytes);
+		free_block(file);
+		void *resized = alloc(p.resized_bytes);
+		touch(resized, p.resized_bytes);
+		free_block(resized);
+		allocations += 3;
+
+		cache.emplace_back(decode, p.decode_bytes);
+		cached += p.decode_bytes;
+		while (cached > cache_bytes) {
+			free_block(cache.front().first);
+			cached -= cache.front().second;
+			cache.pop_front();
+		}
+
+		size_t rss = rss_bytes();
+		peak_rss = std::max(peak_rss, rss);
+		min_rss = std::min(min_rss, rss);
+	}
+	double s = std::chrono::duration<double>(
+				   std::chrono::steady_clock::now() - start)
+				   .count();
+
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	auto &pool = buffer_pool::instance();
+	std::cout << "allocator=" << allocator << " pages=" << pages.size()
+			  << " ms_per_page=" << s * 1000 / pages.size()
+			  << " allocations=" << allocations
+			  << " pool_maps=" << pool.maps << " pool_reuses=" << pool.reuses
+			  << " minor_faults=" << usage.ru_minflt
+			  << " rss_min_mb=" << (min_rss >> 20)
+			  << " rss_peak_mb=" << (peak_rss >> 20) << std::endl;
+}
+
+template <typename Run> void in_child(Run &&run) {
+	if (pid_t pid = fork(); pid == 0) {
+		run();
+		std::cout.flush();
+		_exit(0);
+	} else if (pid > 0)
+		waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char **argv) {
+	int n_pages = argc > 1 ? std::atoi(argv[1]) : 500;
+	size_t cache_bytes = size_t(argc > 2 ? std::atoi(argv[2]) : 512) << 20;
+	auto pages = session(n_pages);
+
+	in_child([&] { replay("malloc", pages, cache_bytes, malloc, free); });
+	in_child([&] {
+		replay("buffer_pool", pages, cache_bytes, buffer_alloc, buffer_free);
+	});
+}
@@ -0,0 +1,125 @@
+// times compute_image_type() on 4000x6000 pages against the version it
+// replaced, which made a column major grey copy of the whole page, and
+// checks both give the same type.
+//
+//   bench/page_type [runs]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "../page_type.hpp"
+
+// the transposing version, as it was
+int transposed_image_type(const uint8_t *pixels, glm::ivec2 size) {
+	int w = size.x, h = size.y;
+
+	std::vector<uint8_t> pixels_cm;
+	pixels_cm.reserve(size_t(w) * h);
+	for (int x = 0; x < w; x++)
+		for (int y = 0; y < h; y++) {
+			const uint8_t *pixel = pixels + (x + size_t(w) * y) * 4;
+			pixels_cm.push_back((pixel[0] + pixel[1] + pixel[2]) / 3);
+		}
+	int depth = 0;
+	int page_type = 3;
+	unsigned int var_left = 0, var_right = 0;
+	while (page_type == 3 && depth++ < 20) {
+		unsigned int color_left = std::accumulate(
+			pixels_cm.begin() + h * depth, pixels_cm.begin() + h * (depth + 1),
+			0);
+		unsigned int color_right =
+			std::accumulate(pixels_cm.end() - h * (depth + 1),
+							pixels_cm.end() - h * depth, 0);
+		color_left = color_left / h;
+		color_right = color_right / h;
+
+		unsigned int accum = 0;
+		std::for_each(pixels_cm.begin(), pixels_cm.begin() + h,
+					  [&](unsigned int d) {
+						  accum += (d - color_left) * (d - color_left);
+					  });
+		var_left = std::max(var_left, accum / h);
+		accum = 0;
+		std::for_each(pixels_cm.end() - h, pixels_cm.end(),
+					  [&](unsigned int d) {
+						  accum += (d - color_right) * (d - color_right);
+					  });
+		var_right = std::max(var_right, accum / h);
+		page_type = ((var_right < 500) << 1) | (var_left < 500);
+	}
+	if (page_type == 3)
+		page_type = 0;
+	return page_type;
+}
+
+// a page of text on grainy paper, with margins on the sides asked for and
+// the picture running off the others
+std::vector<uint8_t> page(glm::ivec2 size, bool left_margin,
+						  bool right_margin) {
+	std::vector<uint8_t> out(size_t(size.x) * size.y * 4);
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int> grain(-4, 4);
+	int margin = size.x / 12;
+	for (int y = 0; y < size.y; ++y)
+		for (int x = 0; x < size.x; ++x) {
+			bool in_margin = (left_margin && x < margin) ||
+							 (right_margin && x >= size.x - margin);
+			int v = 240 + grain(rng);
+			if (!in_margin)
+				v = int(128 + 60 * std::sin(x * 0.05) +
+						60 * std::cos(y * 0.03));
+			uint8_t *p = out.data() + (size_t(y) * size.x + x) * 4;
+			p[0] = p[1] = p[2] = uint8_t(std::clamp(v, 0, 255));
+			p[3] = 255;
+		}
+	return out;
+}
+
+template <class F> double best_ms(int runs, F f) {
+	double best = INFINITY;
+	for (int i = 0; i < runs; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		f();
+		std::chrono::duration<double, std::milli> t =
+			std::chrono::steady_clock::now() - start;
+		best = std::min(best, t.count());
+	}
+	return best;
+}
+
+int main(int argc, char **argv) {
+	int runs = argc > 1 ? std::atoi(argv[1]) : 5;
+	glm::ivec2 size(4000, 6000);
+	struct {
+		const char *name;
+		bool left, right;
+	} pages[] = {
+		{"spread", false, false},
+		{"left_margin", true, false},
+		{"right_margin", false, true},
+		{"both_margins", true, true},
+	};
+	bool all_match = true;
+	for (auto [name, left, right] : pages) {
+		std::vector<uint8_t> pixels = page(size, left, right);
+		int type = 0, old_type = 0;
+		double ms = best_ms(
+			runs, [&] { type = compute_image_type(pixels.data(), size); });
+		double old_ms = best_ms(runs, [&] {
+			old_type = transposed_image_type(pixels.data(), size);
+		});
+		all_match = all_match && type == old_type;
+		std::cout << "page=" << name << " type=" << type
+				  << " old_type=" << old_type << " ms=" << ms
+				  << " old_ms=" << old_ms << '\n';
+	}
+	std::cout << "match=" << all_match << '\n';
+	return all_match ? 0 : 1;
+}
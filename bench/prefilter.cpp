@@ -0,0 +1,117 @@
+// resizes a synthetic scanned page with Lanczos alone and with the box
+// prefilter the resizer uses (halve while more than twice the target, then
+// Lanczos), and prints the time of each and the PSNR of the prefiltered
+// result against Lanczos alone.
+//
+//   bench/prefilter [runs]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <lancir.h>
+
+#include "../box_shrink.hpp"
+
+struct size {
+	int x, y;
+};
+
+// paper grain, lines of text and a screened picture, like a scan
+std::vector<uint8_t> page(size s) {
+	std::vector<uint8_t> out(size_t(s.x) * s.y * 4);
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int> grain(-6, 6);
+	int line = std::max(s.y / 60, 4);
+	for (int y = 0; y < s.y; ++y)
+		for (int x = 0; x < s.x; ++x) {
+			int v = 235 + grain(rng);
+			bool picture = y > s.y / 2 && y < s.y * 3 / 4 && x > s.x / 8 &&
+						   x < s.x * 7 / 8;
+			if (picture) {
+				// a 45 degree screen whose dots grow to the right
+				double dot = 0.5 + 0.5 * std::sin((x + y) * 0.9) *
+									   std::sin((x - y) * 0.9);
+				v = dot < double(x) / s.x ? 30 : 220;
+			} else if (y % line < line / 2 && x > s.x / 10 &&
+					   x < s.x * 9 / 10 && (x / (line / 3 + 1)) % 5 != 0 &&
+					   ((x * 7 + y * 3) / 5) % 4 == 0)
+				v = 20; // strokes of glyphs
+			uint8_t *p = out.data() + (size_t(y) * s.x + x) * 4;
+			p[0] = std::clamp(v + 4, 0, 255);
+			p[1] = std::clamp(v, 0, 255);
+			p[2] = std::clamp(v - 8, 0, 255);
+			p[3] = 255;
+		}
+	return out;
+}
+
+void lanczos(const uint8_t *in, size s, uint8_t *out, size to) {
+	avir::CLancIR resizer;
+	resizer.resizeImage(in, s.x, s.y, out, to.x, to.y, 4);
+}
+
+void prefiltered(const uint8_t *in, size s, uint8_t *out, size to) {
+	std::vector<uint8_t> a, b;
+	while (s.x > 2 * to.x && s.y > 2 * to.y) {
+		b.resize(size_t(s.x / 2) * (s.y / 2) * 4);
+		box_shrink(in, s.x, s.y, b.data());
+		std::swap(a, b);
+		in = a.data();
+		s = {s.x / 2, s.y / 2};
+	}
+	lanczos(in, s, out, to);
+}
+
+double psnr(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+	double sum = 0;
+	for (size_t i = 0; i < a.size(); ++i)
+		if (i % 4 != 3) {
+			double d = double(a[i]) - b[i];
+			sum += d * d;
+		}
+	double mse = sum / (a.size() / 4 * 3);
+	return mse == 0 ? INFINITY : 10 * std::log10(255.0 * 255.0 / mse);
+}
+
+template <class F> double best_ms(int runs, F f) {
+	double best = INFINITY;
+	for (int i = 0; i < runs; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		f();
+		std::chrono::duration<double, std::milli> t =
+			std::chrono::steady_clock::now() - start;
+		best = std::min(best, t.count());
+	}
+	return best;
+}
+
+int main(int argc, char **argv) {
+	int runs = argc > 1 ? std::atoi(argv[1]) : 3;
+	struct {
+		size from, to;
+	} cases[] = {
+		{{4000, 6000}, {2000, 3000}}, {{4000, 6000}, {1300, 1950}},
+		{{4000, 6000}, {1000, 1500}}, {{4000, 6000}, {800, 1200}},
+		{{8000, 11000}, {1300, 1788}},
+	};
+	std::cout << "simd=" << simd_name() << '\n';
+	for (auto [from, to] : cases) {
+		std::vector<uint8_t> src = page(from);
+		std::vector<uint8_t> plain(size_t(to.x) * to.y * 4),
+			boxed(plain.size());
+		double plain_ms = best_ms(
+			runs, [&] { lanczos(src.data(), from, plain.data(), to); });
+		double boxed_ms = best_ms(
+			runs, [&] { prefiltered(src.data(), from, boxed.data(), to); });
+		std::cout << "from=" << from.x << 'x' << from.y << " to=" << to.x
+				  << 'x' << to.y << " lanczos_ms=" << plain_ms
+				  << " prefilter_ms=" << boxed_ms
+				  << " psnr_db=" << psnr(plain, boxed) << '\n';
+	}
+}
@@ -0,0 +1,112 @@
+// cold page cache reads of whole files, by threads doing blocking preads as
+// the loader does without io_uring, and by one io_uring thread keeping up
+// to depth reads in flight (make bench IO_URING=1). Each run first drops
+// the files from the page cache, which works without root for files that
+// aren't dirty.
+//
+//   bench/read_files [threads/depth...] < list_of_files
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../file_reader.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+void drop_from_cache(const std::vector<std::string> &paths) {
+	for (const auto &path : paths) {
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+// bytes read
+size_t read_with_threads(const std::vector<std::string> &paths,
+						 unsigned int n_threads) {
+	std::atomic<size_t> next = 0, bytes = 0;
+	std::vector<std::jthread> threads;
+	for (unsigned int i = 0; i < n_threads; ++i)
+		threads.emplace_back([&] {
+			for (size_t j; (j = next++) < paths.size();)
+				bytes += read_file(paths[j], 0).size();
+		});
+	threads.clear();
+	return bytes;
+}
+
+#ifdef USE_IO_URING
+size_t read_with_ring(const std::vector<std::string> &paths,
+					  unsigned int depth) {
+	read_ring ring;
+	if (!ring.init(depth))
+		return 0;
+
+	size_t next = 0, in_flight = 0, bytes = 0;
+	while (next < paths.size() || in_flight > 0) {
+		while (next < paths.size() && in_flight < depth) {
+			auto read = std::make_unique<file_read>();
+			if (!read->open(paths[next++], 0))
+				continue;
+			ring.submit(*read, read.get());
+			read.release();
+			in_flight++;
+		}
+
+		auto [tag, result] = ring.wait();
+		std::unique_ptr<file_read> done(static_cast<file_read *>(tag));
+		if (!done->advance(result)) {
+			ring.submit(*done, done.release());
+			continue;
+		}
+		bytes += done->finish().size();
+		in_flight--;
+	}
+	return bytes;
+}
+#endif
+
+template <typename Read>
+void run(const char *reader, unsigned int n,
+		 const std::vector<std::string> &paths, Read &&read) {
+	drop_from_cache(paths);
+	auto start = clock_type::now();
+	size_t bytes = read(paths, n);
+	double s = std::chrono::duration<double>(clock_type::now() - start).count();
+	std::cout << "reader=" << reader << " n=" << n << " files=" << paths.size()
+			  << " mb_per_s=" << long(bytes / s / 1e6)
+			  << " files_per_s=" << long(paths.size() / s) << std::endl;
+}
+
+int main(int argc, char **argv) {
+	std::vector<std::string> paths;
+	for (std::string line; std::getline(std::cin, line);)
+		if (!line.empty())
+			paths.push_back(line);
+
+	std::vector<unsigned int> counts;
+	for (int i = 1; i < argc; ++i)
+		counts.push_back(std::max(std::atoi(argv[i]), 1));
+	if (counts.empty())
+		counts = {1, 2, 8, 32};
+
+	for (unsigned int n : counts) {
+		run("pread", n, paths, read_with_threads);
+#ifdef USE_IO_URING
+		run("io_uring", n, paths, read_with_ring);
+#endif
+	}
+}
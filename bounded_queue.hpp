@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+
+// FIFO between two loader stages, producers block while it's full
+template <typename T> class bounded_queue {
+  private:
+	std::deque<T> items;
+	size_t capacity = 1;
+
+	std::mutex mutex;
+	std::condition_variable_any not_empty, not_full;
+
+	template <typename Wait> std::optional<T> pop(Wait &&wait) {
+		std::unique_lock lk(mutex);
+		if (!wait(lk))
+			return std::nullopt;
+
+		T item = std::move(items.front());
+		items.pop_front();
+		lk.unlock();
+		not_full.notify_one();
+		return item;
+	}
+
+  public:
+	void set_capacity(size_t new_capacity) {
+		std::scoped_lock lk(mutex);
+		capacity = new_capacity;
+		not_full.notify_all();
+	}
+
+	// false if stop was requested before there was room for item
+	bool push(T &&item, std::stop_token stop) {
+		std::unique_lock lk(mutex);
+		if (!not_full.wait(lk, stop,
+						   [this] { return items.size() < capacity; }))
+			return false;
+
+		items.push_back(std::move(item));
+		lk.unlock();
+		not_empty.notify_one();
+		return true;
+	}
+
+	// doesn't wait for room, for consumers splitting up the item they took
+	void push_now(T &&item) {
+		{
+			std::scoped_lock lk(mutex);
+			items.push_back(std::move(item));
+		}
+		not_empty.notify_one();
+	}
+
+	// empty if stop was requested before an item was available
+	std::optional<T> pop(std::stop_token stop) {
+		return pop([this, &stop](auto &lk) {
+			return not_empty.wait(lk, stop, [this] { return !items.empty(); });
+		});
+	}
+
+	// also empty once timeout expired without an item
+	template <typename Rep, typename Period>
+	std::optional<T> pop(std::stop_token stop,
+						 std::chrono::duration<Rep, Period> timeout) {
+		return pop([this, &stop, timeout](auto &lk) {
+			return not_empty.wait_for(lk, stop, timeout,
+									  [this] { return !items.empty(); });
+		});
+	}
+
+	size_t size() {
+		std::scoped_lock lk(mutex);
+		return items.size();
+	}
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu_dispatch.hpp"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// halves an RGBA image, each output pixel the rounded mean of a 2x2 block.
+// An odd last row or column is dropped. Big reductions go through this
+// first so the Lanczos filter, whose cost follows the source size, only
+// does the last step
+
+// rows of 2 * out_w source pixels to out_w output pixels, from x on
+inline void box_shrink_row_scalar(const uint8_t *row0, const uint8_t *row1,
+								  uint8_t *out, int x, int out_w) {
+	for (; x < out_w; ++x)
+		for (int c = 0; c < 4; ++c) {
+			const uint8_t *a = row0 + x * 8 + c, *b = row1 + x * 8 + c;
+			out[x * 4 + c] = (a[0] + a[4] + b[0] + b[4] + 2) >> 2;
+		}
+}
+
+#if defined(__AVX2__) || defined(DISPATCH_AVX2)
+AVX2_TARGET inline void box_shrink_row_avx2(const uint8_t *row0,
+											const uint8_t *row1, uint8_t *out,
+											int out_w) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i two = _mm256_set1_epi16(2);
+	int x = 0;
+	for (; x + 4 <= out_w; x += 4) {
+		// 8 source pixels per row, each 128 bit lane holds 4 of them
+		__m256i a = _mm256_loadu_si256((const __m256i *)(row0 + x * 8));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(row1 + x * 8));
+		__m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero),
+									  _mm256_unpacklo_epi8(b, zero));
+		__m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero),
+									  _mm256_unpackhi_epi8(b, zero));
+		lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+		hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+		__m256i sum = _mm256_unpacklo_epi64(lo, hi);
+		sum = _mm256_srli_epi16(_mm256_add_epi16(sum, two), 2);
+		__m256i packed = _mm256_permute4x64_epi64(
+			_mm256_packus_epi16(sum, sum), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i *)(out + x * 4),
+						 _mm256_castsi256_si128(packed));
+	}
+	box_shrink_row_scalar(row0, row1, out, x, out_w);
+}
+#endif
+
+#if defined(__AVX2__)
+inline void box_shrink_row(const uint8_t *row0, const uint8_t *row1,
+						   uint8_t *out, int out_w) {
+	box_shrink_row_avx2(row0, row1, out, out_w);
+}
+#elif defined(__SSE2__)
+inline void box_shrink_row(const uint8_t *row0, const uint8_t *row1,
+						   uint8_t *out, int out_w) {
+#ifdef DISPATCH_AVX2
+	if (use_avx2()) {
+		box_shrink_row_avx2(row0, row1, out, out_w);
+		return;
+	}
+#endif
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i two = _mm_set1_epi16(2);
+	int x = 0;
+	for (; x + 2 <= out_w; x += 2) {
+		// 4 source pixels per row
+		__m128i a = _mm_loadu_si128((const __m128i *)(row0 + x * 8));
+		__m128i b = _mm_loadu_si128((const __m128i *)(row1 + x * 8));
+		__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+								   _mm_unpacklo_epi8(b, zero));
+		__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+								   _mm_unpackhi_epi8(b, zero));
+		lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+		hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+		__m128i sum = _mm_unpacklo_epi64(lo, hi);
+		sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+		_mm_storel_epi64((__m128i *)(out + x * 4), _mm_packus_epi16(sum, sum));
+	}
+	box_shrink_row_scalar(row0, row1, out, x, out_w);
+}
+#elif defined(__ARM_NEON)
+inline void box_shrink_row(const uint8_t *row0, const uint8_t *row1,
+						   uint8_t *out, int out_w) {
+	int x = 0;
+	for (; x + 4 <= out_w; x += 4) {
+		// 8 source pixels per row, split in even and odd ones
+		uint32x4x2_t a = vld2q_u32((const uint32_t *)(row0 + x * 8));
+		uint32x4x2_t b = vld2q_u32((const uint32_t *)(row1 + x * 8));
+		uint8x16_t a0 = vreinterpretq_u8_u32(a.val[0]);
+		uint8x16_t a1 = vreinterpretq_u8_u32(a.val[1]);
+		uint8x16_t b0 = vreinterpretq_u8_u32(b.val[0]);
+		uint8x16_t b1 = vreinterpretq_u8_u32(b.val[1]);
+		uint16x8_t lo =
+			vaddq_u16(vaddl_u8(vget_low_u8(a0), vget_low_u8(a1)),
+					  vaddl_u8(vget_low_u8(b0), vget_low_u8(b1)));
+		uint16x8_t hi =
+			vaddq_u16(vaddl_u8(vget_high_u8(a0), vget_high_u8(a1)),
+					  vaddl_u8(vget_high_u8(b0), vget_high_u8(b1)));
+		vst1q_u8(out + x * 4,
+				 vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+	}
+	box_shrink_row_scalar(row0, row1, out, x, out_w);
+}
+#else
+inline void box_shrink_row(const uint8_t *row0, const uint8_t *row1,
+						   uint8_t *out, int out_w) {
+	box_shrink_row_scalar(row0, row1, out, 0, out_w);
+}
+#endif
+
+// out must hold (w / 2) * (h / 2) pixels
+inline void box_shrink(const uint8_t *in, int w, int h, uint8_t *out) {
+	size_t stride = size_t(w) * 4;
+	int out_w = w / 2, out_h = h / 2;
+	for (int y = 0; y < out_h; ++y)
+		box_shrink_row(in + 2 * y * stride, in + (2 * y + 1) * stride,
+					   out + size_t(y) * out_w * 4, out_w);
+}
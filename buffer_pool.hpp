@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+// allocator for decoded and resized pixels. Small blocks come from malloc,
+// large ones are mmapped in size classes a quarter power of two apart and
+// kept for reuse once freed, up to a retained byte limit. trim() gives the
+// kept ones back to the OS. Large blocks start on a page boundary, so files
+// can be read into them with O_DIRECT
+class buffer_pool {
+  private:
+	struct alignas(64) header {
+		size_t capacity;
+		int size_class; // -1 for malloc blocks
+	};
+
+	static constexpr size_t large_bytes = size_t(1) << 20;
+	// the header of a large block sits at the end of the page before it
+	static constexpr size_t large_offset = 4096;
+
+	std::unordered_map<int, std::vector<header *>> free_buffers;
+	size_t retained_bytes = 0;
+	size_t retain_limit = size_t(256) << 20;
+	std::mutex mutex;
+
+	// capacity (4 + class % 4) << (class / 4 - 2), the smallest fitting bytes
+	static int size_class(size_t bytes) {
+		int log2 = std::bit_width(bytes) - 1;
+		size_t step = size_t(1) << (log2 - 2);
+		int quarter = (bytes + step - 1) / step - 4;
+		if (quarter == 4)
+			return (log2 + 1) * 4;
+		return log2 * 4 + quarter;
+	}
+
+	static size_t class_capacity(int size_class) {
+		return size_t(4 + size_class % 4) << (size_class / 4 - 2);
+	}
+
+	void unmap(header *h) {
+		size_t capacity = h->capacity;
+		munmap(reinterpret_cast<char *>(h + 1) - large_offset,
+			   large_offset + capacity);
+		mapped_bytes -= capacity;
+		unmaps++;
+	}
+
+  public:
+	std::atomic<uint64_t> allocations = 0;
+	std::atomic<uint64_t> reuses = 0;
+	std::atomic<uint64_t> maps = 0;
+	std::atomic<uint64_t> unmaps = 0;
+	std::atomic<size_t> mapped_bytes = 0;
+
+	static buffer_pool &instance() {
+		static buffer_pool pool;
+		return pool;
+	}
+
+	void set_retain_limit(size_t bytes) {
+		retain_limit = bytes;
+		trim(bytes);
+	}
+
+	void *allocate(size_t bytes) {
+		allocations++;
+		if (bytes < large_bytes) {
+			auto h = static_cast<header *>(malloc(sizeof(header) + bytes));
+			if (!h)
+				return nullptr;
+			*h = {bytes, -1};
+			return h + 1;
+		}
+
+		int cls = size_class(bytes);
+		{
+			std::scoped_lock lk(mutex);
+			auto &buffers = free_buffers[cls];
+			if (!buffers.empty()) {
+				header *h = buffers.back();
+				buffers.pop_back();
+				retained_bytes -= h->capacity;
+				reuses++;
+				return h + 1;
+			}
+		}
+
+		size_t capacity = class_capacity(cls);
+		void *map = mmap(nullptr, large_offset + capacity,
+						 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+						 -1, 0);
+		if (map == MAP_FAILED)
+			return nullptr;
+
+		maps++;
+		mapped_bytes += capacity;
+		char *data = static_cast<char *>(map) + large_offset;
+		auto h = reinterpret_cast<header *>(data) - 1;
+		*h = {capacity, cls};
+		return h + 1;
+	}
+
+	void deallocate(void *ptr) {
+		if (!ptr)
+			return;
+
+		header *h = static_cast<header *>(ptr) - 1;
+		if (h->size_class == -1) {
+			free(h);
+			return;
+		}
+
+		std::scoped_lock lk(mutex);
+		if (retained_bytes + h->capacity > retain_limit) {
+			unmap(h);
+			return;
+		}
+		free_buffers[h->size_class].push_back(h);
+		retained_bytes += h->capacity;
+	}
+
+	void *reallocate(void *ptr, size_t bytes) {
+		if (!ptr)
+			return allocate(bytes);
+
+		header *h = static_cast<header *>(ptr) - 1;
+		if (bytes <= h->capacity)
+			return ptr;
+
+		void *grown = allocate(bytes);
+		if (grown) {
+			memcpy(grown, ptr, h->capacity);
+			deallocate(ptr);
+		}
+		return grown;
+	}
+
+	// unmaps kept buffers until at most keep_bytes are retained
+	void trim(size_t keep_bytes = 0) {
+		std::scoped_lock lk(mutex);
+		for (auto &[cls, buffers] : free_buffers)
+			while (retained_bytes > keep_bytes && !buffers.empty()) {
+				retained_bytes -= buffers.back()->capacity;
+				unmap(buffers.back());
+				buffers.pop_back();
+			}
+	}
+};
+
+inline void *buffer_alloc(size_t bytes) {
+	return buffer_pool::instance().allocate(bytes);
+}
+
+inline void *buffer_realloc(void *ptr, size_t bytes) {
+	return buffer_pool::instance().reallocate(ptr, bytes);
+}
+
+inline void buffer_free(void *ptr) { buffer_pool::instance().deallocate(ptr); }
+
+// owning handle to a block of the buffer pool
+class pooled_buffer {
+  private:
+	uint8_t *ptr = nullptr;
+	size_t len = 0;
+
+  public:
+	pooled_buffer() = default;
+	explicit pooled_buffer(size_t bytes)
+		: ptr(static_cast<uint8_t *>(buffer_alloc(bytes))),
+		  len(ptr ? bytes : 0) {}
+	pooled_buffer(pooled_buffer &&other)
+		: ptr(std::exchange(other.ptr, nullptr)),
+		  len(std::exchange(other.len, 0)) {}
+	pooled_buffer &operator=(pooled_buffer &&other) {
+		std::swap(ptr, other.ptr);
+		std::swap(len, other.len);
+		return *this;
+	}
+	~pooled_buffer() { buffer_free(ptr); }
+
+	uint8_t *data() const { return ptr; }
+	size_t size() const { return len; }
+	bool empty() const { return len == 0; }
+
+	// keeps the block, only forgets about the bytes past new_size
+	void shrink(size_t new_size) { len = std::min(len, new_size); }
+};
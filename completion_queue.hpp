@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+// lock-free multiple producer, single consumer queue. Producers push onto an
+// intrusive stack, the consumer takes the whole stack at once and hands the
+// items out in push order
+template <typename T> class completion_queue {
+  private:
+	struct node {
+		T value;
+		node *next;
+	};
+
+	std::atomic<node *> head = nullptr;
+
+  public:
+	completion_queue() = default;
+	completion_queue(const completion_queue &) = delete;
+	~completion_queue() { drain([](T &&) {}); }
+
+	void push(T &&value) {
+		node *n = new node{std::move(value),
+						   head.load(std::memory_order_relaxed)};
+		while (!head.compare_exchange_weak(n->next, n,
+										   std::memory_order_release,
+										   std::memory_order_relaxed))
+			;
+	}
+
+	// calls consume(T &&) on everything pushed so far, oldest first. Only
+	// from one thread at a time
+	template <typename F> void drain(F &&consume) {
+		node *n = head.exchange(nullptr, std::memory_order_acquire);
+
+		node *oldest = nullptr;
+		while (n)
+			oldest = std::exchange(n, std::exchange(n->next, oldest));
+
+		while (oldest) {
+			consume(std::move(oldest->value));
+			delete std::exchange(oldest, oldest->next);
+		}
+	}
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+// on x86-64 the SIMD kernels are built twice when the compiler flags stop
+// short of AVX2: for the baseline, and with target attributes for AVX2 and
+// FMA. The second build is used if the CPU runs it, so one binary makes
+// the most of any machine
+#if defined(__x86_64__) && !defined(__AVX2__) &&                              \
+	(defined(__GNUC__) || defined(__clang__))
+#define DISPATCH_AVX2
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+#else
+#define AVX2_TARGET
+#endif
+
+// true if the AVX2 builds are to be used, checked once
+inline bool use_avx2() {
+#ifdef DISPATCH_AVX2
+	static const bool avx2 =
+		__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	return avx2;
+#else
+	return false;
+#endif
+}
+
+// instruction set the box shrink runs with
+inline const char *simd_name() {
+#if defined(__AVX2__)
+	return "avx2";
+#elif defined(__x86_64__) || defined(__SSE2__)
+	return use_avx2() ? "avx2" : "sse2";
+#elif defined(__ARM_NEON)
+	return "neon";
+#else
+	return "scalar";
+#endif
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <glm/glm.hpp>
+#include <stb_image.h>
+
+struct decoded_image {
+	uint8_t *pixels; // RGBA, allocated by stb_image
+	glm::ivec2 size;
+
+	decoded_image(uint8_t *pixels, glm::ivec2 size)
+		: pixels(pixels), size(size) {}
+	decoded_image(const decoded_image &) = delete;
+	decoded_image &operator=(const decoded_image &) = delete;
+	~decoded_image() { stbi_image_free(pixels); }
+
+	size_t bytes() const { return size_t(size.x) * size.y * 4; }
+};
+
+using shared_image = std::shared_ptr<const decoded_image>;
+
+// full resolution decodes keyed by path, so that loading the same file at
+// another size doesn't go through the decoder again. Least recently used
+// images are dropped once over budget, users keep theirs alive until done
+class decode_cache {
+  private:
+	struct entry {
+		std::shared_future<shared_image> image;
+		size_t bytes = 0; // 0 while still decoding
+		uint64_t last_use = 0;
+		bool keep = true; // false to drop it once decoded
+	};
+
+	std::unordered_map<std::string, entry> entries;
+	size_t budget = 0;
+	size_t used = 0;
+	uint64_t tick = 0;
+	std::mutex mutex;
+
+	void evict() {
+		while (used > budget) {
+			auto lru = entries.end();
+			for (auto it = entries.begin(); it != entries.end(); ++it)
+				if (it->second.bytes != 0 &&
+					(lru == entries.end() ||
+					 it->second.last_use < lru->second.last_use))
+					lru = it;
+			if (lru == entries.end())
+				return;
+
+			used -= lru->second.bytes;
+			entries.erase(lru);
+		}
+	}
+
+  public:
+	void set_budget(size_t bytes) {
+		std::scoped_lock lk(mutex);
+		budget = bytes;
+		evict();
+	}
+
+	// the cached or still running decode of path, invalid if there is none.
+	// Holding it keeps the image alive after it's dropped from the cache
+	std::shared_future<shared_image> find(const std::string &path) {
+		std::scoped_lock lk(mutex);
+		auto it = entries.find(path);
+		if (it == entries.end())
+			return {};
+		it->second.last_use = tick++;
+		return it->second.image;
+	}
+
+	// returns the cached decode of path, or runs decode() to produce it.
+	// Concurrent calls for the same path wait for a single decode, which is
+	// only kept if one of them wants to keep it
+	template <typename F>
+	shared_image get(const std::string &path, F &&decode, bool keep = true) {
+		std::unique_lock lk(mutex);
+		auto it = entries.find(path);
+		if (it != entries.end()) {
+			it->second.last_use = tick++;
+			it->second.keep = it->second.keep || keep;
+			auto image = it->second.image;
+			lk.unlock();
+			return image.get();
+		}
+
+		std::promise<shared_image> decoded;
+		entries[path] = {decoded.get_future().share(), 0, tick++, keep};
+		lk.unlock();
+
+		shared_image image = decode();
+
+		lk.lock();
+		entry &done = entries[path];
+		if (image && done.keep) {
+			done.bytes = image->bytes();
+			used += image->bytes();
+			evict();
+		} else
+			entries.erase(path); // let the next request retry
+		lk.unlock();
+
+		decoded.set_value(image);
+		return image;
+	}
+};
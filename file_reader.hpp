@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "buffer_pool.hpp"
+
+// a file being read whole into a pooled buffer, by pread or io_uring
+class file_read {
+  private:
+	static constexpr size_t block_bytes = 4096; // O_DIRECT alignment
+
+	int fd = -1;
+	bool direct = false;
+	size_t file_size = 0;
+	size_t done = 0;
+	pooled_buffer data;
+
+  public:
+	file_read() = default;
+	file_read(const file_read &) = delete;
+	~file_read() {
+		if (fd != -1)
+			close(fd);
+	}
+
+	// O_DIRECT for files of at least direct_bytes, 0 for never, so very
+	// large scans don't push everything else out of the page cache
+	bool open(const std::string &path, size_t direct_bytes) {
+		fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd == -1 || fstat(fd, &st) == -1 || st.st_size <= 0)
+			return false;
+
+		file_size = st.st_size;
+		if (direct_bytes != 0 && file_size >= direct_bytes) {
+			int direct_fd =
+				::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+			if (direct_fd != -1) {
+				close(fd);
+				fd = direct_fd;
+				direct = true;
+			}
+		}
+
+		// whole blocks, O_DIRECT reads can't stop at the end of the file
+		size_t blocks = (file_size + block_bytes - 1) / block_bytes;
+		data = pooled_buffer(blocks * block_bytes);
+		return !data.empty();
+	}
+
+	int descriptor() const { return fd; }
+	uint8_t *next() const { return data.data() + done; }
+	size_t remaining() const { return data.size() - done; }
+	size_t offset() const { return done; }
+
+	// takes the result of the last read, bytes or -errno. false if another
+	// read is needed
+	bool advance(ssize_t result) {
+		if (result == -EINTR || result == -EAGAIN)
+			return false;
+		if (result == -EINVAL && direct) { // not supported after all
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			direct = false;
+			return false;
+		}
+		if (result < 0) {
+			data = {};
+			return true;
+		}
+
+		done += result;
+		return result == 0 || done >= file_size;
+	}
+
+	// the file contents, empty if reading failed
+	pooled_buffer finish() {
+		data.shrink(std::min(done, file_size));
+		return std::move(data);
+	}
+};
+
+// reads all of path with blocking preads
+inline pooled_buffer read_file(const std::string &path, size_t direct_bytes) {
+	file_read read;
+	if (!read.open(path, direct_bytes))
+		return {};
+
+	while (true) {
+		ssize_t n = pread(read.descriptor(), read.next(), read.remaining(),
+						  read.offset());
+		if (read.advance(n < 0 ? -errno : n))
+			return read.finish();
+	}
+}
+
+#ifdef USE_IO_URING
+// io_uring for file_reads, each submitted with a tag given back once the
+// read completes. Used by one thread, straight through the kernel interface
+// so there is no library to depend on
+class read_ring {
+  private:
+	int ring_fd = -1;
+	void *sq_map = MAP_FAILED, *cq_map = MAP_FAILED;
+	size_t sq_map_bytes = 0, cq_map_bytes = 0;
+	io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+	size_t sqes_bytes = 0;
+
+	// shared with the kernel, which moves cq_tail
+	unsigned int *sq_tail, *sq_array, sq_mask;
+	unsigned int *cq_head, *cq_tail, cq_mask;
+	io_uring_cqe *cqes;
+
+	template <typename T> static T *at(void *map, size_t offset) {
+		return reinterpret_cast<T *>(static_cast<char *>(map) + offset);
+	}
+
+	int enter(unsigned int to_submit, unsigned int min_complete) {
+		return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+					   min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+	}
+
+  public:
+	read_ring() = default;
+	read_ring(const read_ring &) = delete;
+	~read_ring() {
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqes_bytes);
+		if (cq_map != MAP_FAILED && cq_map != sq_map)
+			munmap(cq_map, cq_map_bytes);
+		if (sq_map != MAP_FAILED)
+			munmap(sq_map, sq_map_bytes);
+		if (ring_fd != -1)
+			close(ring_fd);
+	}
+
+	// false if the kernel doesn't let us have one
+	bool init(unsigned int depth) {
+		io_uring_params params{};
+		ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+		// IORING_OP_READ came with the same kernel, 5.6
+		if (ring_fd == -1 || !(params.features & IORING_FEAT_RW_CUR_POS))
+			return false;
+
+		sq_map_bytes = params.sq_off.array + params.sq_entries * 4;
+		cq_map_bytes =
+			params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_map)
+			sq_map_bytes = cq_map_bytes =
+				std::max(sq_map_bytes, cq_map_bytes);
+
+		auto map = [this](size_t bytes, off_t offset) {
+			return mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+		};
+		sq_map = map(sq_map_bytes, IORING_OFF_SQ_RING);
+		if (sq_map == MAP_FAILED)
+			return false;
+		cq_map = single_map ? sq_map : map(cq_map_bytes, IORING_OFF_CQ_RING);
+		sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = static_cast<io_uring_sqe *>(map(sqes_bytes, IORING_OFF_SQES));
+		if (cq_map == MAP_FAILED || sqes == MAP_FAILED)
+			return false;
+
+		sq_tail = at<unsigned int>(sq_map, params.sq_off.tail);
+		sq_array = at<unsigned int>(sq_map, params.sq_off.array);
+		sq_mask = *at<unsigned int>(sq_map, params.sq_off.ring_mask);
+		cq_head = at<unsigned int>(cq_map, params.cq_off.head);
+		cq_tail = at<unsigned int>(cq_map, params.cq_off.tail);
+		cq_mask = *at<unsigned int>(cq_map, params.cq_off.ring_mask);
+		cqes = at<io_uring_cqe>(cq_map, params.cq_off.cqes);
+		return true;
+	}
+
+	// at most depth reads may be in flight
+	void submit(const file_read &read, void *tag) {
+		unsigned int tail = *sq_tail, index = tail & sq_mask;
+		io_uring_sqe &sqe = sqes[index];
+		sqe = {};
+		sqe.opcode = IORING_OP_READ;
+		sqe.fd = read.descriptor();
+		sqe.addr = reinterpret_cast<uint64_t>(read.next());
+		// short reads are continued by file_read::advance
+		sqe.len = std::min<size_t>(read.remaining(), 1u << 30);
+		sqe.off = read.offset();
+		sqe.user_data = reinterpret_cast<uint64_t>(tag);
+		sq_array[index] = index;
+		std::atomic_ref(*sq_tail).store(tail + 1, std::memory_order_release);
+		while (enter(1, 0) == -1 && errno == EINTR)
+			;
+	}
+
+	// waits for a read to complete, returns its tag and result
+	std::pair<void *, int> wait() {
+		unsigned int head = *cq_head;
+		while (std::atomic_ref(*cq_tail).load(std::memory_order_acquire) ==
+			   head)
+			enter(0, 1);
+
+		const io_uring_cqe &cqe = cqes[head & cq_mask];
+		std::pair<void *, int> completed{
+			reinterpret_cast<void *>(cqe.user_data), cqe.res};
+		std::atomic_ref(*cq_head).store(head + 1, std::memory_order_release);
+		return completed;
+	}
+};
+#endif
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glm/glm.hpp>
+
+// image size read straight from the JPEG, PNG, GIF or BMP header, without
+// decoding anything. at(offset, n) gives n bytes of the file or nullptr.
+// Empty for other formats and broken files
+template <typename At> std::optional<glm::ivec2> parse_image_size(At &&at) {
+	auto be16 = [](const uint8_t *p) { return p[0] << 8 | p[1]; };
+	auto le16 = [](const uint8_t *p) { return p[0] | p[1] << 8; };
+	auto be32 = [](const uint8_t *p) {
+		return int32_t(uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+	};
+	auto le32 = [](const uint8_t *p) {
+		return int32_t(p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24);
+	};
+
+	const uint8_t *p = at(0, 26);
+	if (!p)
+		return std::nullopt;
+
+	std::optional<glm::ivec2> size;
+	if (memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0 &&
+		memcmp(p + 12, "IHDR", 4) == 0)
+		size = {be32(p + 16), be32(p + 20)};
+	else if (memcmp(p, "GIF87a", 6) == 0 || memcmp(p, "GIF89a", 6) == 0)
+		size = {le16(p + 6), le16(p + 8)};
+	else if (memcmp(p, "BM", 2) == 0) {
+		if (le32(p + 14) == 12) // OS/2 bitmap
+			size = {le16(p + 18), le16(p + 20)};
+		else
+			size = {le32(p + 18), std::abs(le32(p + 22))};
+	} else if (p[0] == 0xff && p[1] == 0xd8) {
+		// walk the segments up to the first start of frame
+		off_t pos = 2;
+		while (const uint8_t *seg = at(pos, 9)) {
+			if (seg[0] != 0xff)
+				break;
+			int marker = seg[1];
+			if (marker == 0xff) { // fill byte
+				pos++;
+				continue;
+			}
+			if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 &&
+				marker != 0xc8 && marker != 0xcc) {
+				size = {be16(seg + 7), be16(seg + 5)};
+				break;
+			}
+			if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8))
+				pos += 2; // no length
+			else
+				pos += 2 + be16(seg + 2);
+		}
+	}
+
+	if (size && (size->x <= 0 || size->y <= 0))
+		return std::nullopt;
+	return size;
+}
+
+// usually one read of the first few KB, JPEGs with big metadata segments
+// before the frame header take a few more
+inline std::optional<glm::ivec2> probe_image_size(const std::string &path) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return std::nullopt;
+
+	uint8_t buf[4096];
+	off_t buf_start = 0;
+	ssize_t buf_len = pread(fd, buf, sizeof(buf), 0);
+
+	// n bytes at file offset pos, reading them in if they aren't in buf
+	auto size = parse_image_size([&](off_t pos, ssize_t n) -> const uint8_t * {
+		if (pos < buf_start || pos + n > buf_start + buf_len) {
+			buf_start = pos;
+			buf_len = pread(fd, buf, sizeof(buf), pos);
+			if (buf_len < n)
+				return nullptr;
+		}
+		return buf + (pos - buf_start);
+	});
+	close(fd);
+	return size;
+}
+
+inline std::optional<glm::ivec2> probe_image_size(const uint8_t *data,
+												  size_t len) {
+	return parse_image_size([=](off_t pos, ssize_t n) -> const uint8_t * {
+		return pos + n <= off_t(len) ? data + pos : nullptr;
+	});
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <string>
+
+#include <glm/glm.hpp>
+
+#ifdef USE_LIBJPEG
+#include <csetjmp>
+#include <cstdio>
+
+#include <jpeglib.h>
+#endif
+
+#include "buffer_pool.hpp"
+
+// decoding JPEGs at a fraction of their size costs a fraction of the IDCT
+// work and of the memory, so big scans shown small are decoded by libjpeg
+// at the smallest of 1/2, 1/4 and 1/8 still at least as big as the target
+
+inline bool has_jpeg_extension(const std::string &path) {
+	auto dot = path.find_last_of('.');
+	if (dot == std::string::npos)
+		return false;
+	std::string ext = path.substr(dot + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(),
+				   [](unsigned char c) { return std::tolower(c); });
+	return ext == "jpg" || ext == "jpeg" || ext == "jpe" || ext == "jfif";
+}
+
+// 1 when a full decode is needed
+inline int jpeg_scale_denom(glm::ivec2 image_size, glm::ivec2 target) {
+#ifdef USE_LIBJPEG
+	for (int denom : {8, 4, 2})
+		if ((image_size.x + denom - 1) / denom >= target.x &&
+			(image_size.y + denom - 1) / denom >= target.y)
+			return denom;
+#endif
+	return 1;
+}
+
+#ifdef USE_LIBJPEG
+// RGBA pixels of the JPEG in data at 1/scale_denom of its size, allocated
+// with buffer_alloc. nullptr if it isn't a JPEG libjpeg can decode
+inline uint8_t *decode_jpeg_scaled(const uint8_t *data, size_t len,
+								   int scale_denom, glm::ivec2 &size) {
+	if (len < 3 || data[0] != 0xff || data[1] != 0xd8)
+		return nullptr;
+
+	// libjpeg reports fatal errors by calling error_exit, which must not
+	// return
+	struct error_manager {
+		jpeg_error_mgr mgr;
+		std::jmp_buf jump;
+	};
+	jpeg_decompress_struct cinfo;
+	error_manager err;
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = [](j_common_ptr cinfo) {
+		std::longjmp(reinterpret_cast<error_manager *>(cinfo->err)->jump, 1);
+	};
+	err.mgr.output_message = [](j_common_ptr) {};
+
+	uint8_t *volatile pixels = nullptr;
+	if (setjmp(err.jump)) {
+		buffer_free(pixels);
+		jpeg_destroy_decompress(&cinfo);
+		return nullptr;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, data, len);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = scale_denom;
+	cinfo.out_color_space = JCS_EXT_RGBA;
+	jpeg_start_decompress(&cinfo);
+
+	size = {int(cinfo.output_width), int(cinfo.output_height)};
+	size_t stride = size_t(size.x) * 4;
+	pixels = static_cast<uint8_t *>(buffer_alloc(stride * size.y));
+	if (!pixels) {
+		jpeg_destroy_decompress(&cinfo);
+		return nullptr;
+	}
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW row = pixels + cinfo.output_scanline * stride;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return pixels;
+}
+#endif
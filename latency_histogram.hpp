@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+// durations in buckets a quarter power of two apart, recorded with relaxed
+// atomic increments so any thread can add to it without taking a lock
+class latency_histogram {
+  private:
+	static constexpr int n_buckets = 64 * 4;
+	std::array<std::atomic<uint64_t>, n_buckets> counts{};
+
+	static int bucket(uint64_t ns) {
+		if (ns < 4)
+			return ns;
+		int log2 = std::bit_width(ns) - 1;
+		return log2 * 4 + int(ns >> (log2 - 2)) - 4;
+	}
+
+	// smallest duration not in the bucket
+	static uint64_t bucket_end(int bucket) {
+		if (bucket < 8)
+			return bucket + 1;
+		return uint64_t(4 + bucket % 4 + 1) << (bucket / 4 - 2);
+	}
+
+  public:
+	void record(std::chrono::nanoseconds elapsed) {
+		uint64_t ns = std::max<int64_t>(elapsed.count(), 0);
+		counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void record_since(std::chrono::steady_clock::time_point start) {
+		record(std::chrono::steady_clock::now() - start);
+	}
+
+	// upper bound of the fraction q of durations, in microseconds. Only a
+	// snapshot when other threads are recording
+	double quantile_us(double q) const {
+		std::array<uint64_t, n_buckets> snapshot;
+		uint64_t total = 0;
+		for (int i = 0; i < n_buckets; ++i)
+			total += snapshot[i] = counts[i].load(std::memory_order_relaxed);
+		if (total == 0)
+			return 0.0;
+
+		uint64_t rank = std::max<uint64_t>(q * total + 0.5, 1);
+		for (int i = 0; i < n_buckets; ++i)
+			if (rank <= snapshot[i])
+				return bucket_end(i) / 1000.0;
+			else
+				rank -= snapshot[i];
+		return bucket_end(n_buckets - 1) / 1000.0;
+	}
+};
@@ -1,11 +1,16 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <deque>
-#include <future>
+#include <filesystem>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <numeric>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
@@ -13,6 +18,24 @@
 #include <glm/glm.hpp>
 #include <lancir.h>
 
+#include "bounded_queue.hpp"
+#include "box_shrink.hpp"
+#include "buffer_pool.hpp"
+#include "completion_queue.hpp"
+#include "decode_cache.hpp"
+#include "file_reader.hpp"
+#include "image_probe.hpp"
+#include "jpeg_decoder.hpp"
+#include "latency_histogram.hpp"
+#include "mapped_file.hpp"
+#include "metadata_cache.hpp"
+#include "page_type.hpp"
+#include "pbo_ring.hpp"
+#include "stage_governor.hpp"
+
+#define STBI_MALLOC(size) buffer_alloc(size)
+#define STBI_REALLOC(ptr, size) buffer_realloc(ptr, size)
+#define STBI_FREE(ptr) buffer_free(ptr)
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
@@ -22,173 +45,818 @@
 
 #include "shader.hpp"
 
-int compute_image_type(uint8_t *pixels, glm::ivec2 size) {
-	int w = size.x, h = size.y;
+using cancel_flag = std::shared_ptr<std::atomic<bool>>;
+
+// texture requested from texture_load_pool, owned by the main thread
+struct texture_handle {
+	GLuint tex = 0; // 0 until the load completes
+	cancel_flag cancelled;
+};
+
+enum class completion_kind { image_size, image_type, texture };
+
+// result of a request, handed to the main thread by drain_completions()
+struct load_completion {
+	completion_kind kind;
+	int image_index;
+	glm::ivec2 size; // of the image, or of the texture
+	int image_type = 0;
+	GLuint texture = 0;
+};
+
+struct loader_config {
+	unsigned int read_threads = 1;
+	// threads reading files, each with up to io_depth reads in flight when
+	// built with USE_IO_URING, one at a time otherwise or if io_uring isn't
+	// available. Files of direct_io_bytes or more (0 for none) are read with
+	// O_DIRECT
+	unsigned int io_threads = 2;
+	unsigned int io_depth = 32;
+	size_t direct_io_bytes = 0;
+	// files from mmap_bytes (0 for none) up to direct_io_bytes are mapped
+	// and decoded in place instead, the last mapped_files mappings are kept
+	size_t mmap_bytes = size_t(1) << 20;
+	size_t mapped_files = 64;
+	// threads reading image sizes from headers for probe_sizes(), in
+	// batches of probe_batch files
+	unsigned int probe_threads = 4;
+	size_t probe_batch = 64;
+	// decode and resize workers are started up front, the governor keeps
+	// between min_active_workers and this many of them taking jobs
+	unsigned int decode_threads = 1;
+	unsigned int resize_threads = 1;
+	unsigned int min_active_workers = 1;
+	std::chrono::milliseconds governor_interval{250};
+	// while the rest of the system keeps the cores busy only requests up to
+	// this priority are served
+	int busy_priority_limit = 2;
+	size_t queue_capacity = 4; // jobs waiting between two stages
+	// halve images with a box filter while they're more than twice the
+	// requested size, so the Lanczos resize always does a last step of up
+	// to 2x
+	bool box_prefilter = true;
+	// resizes are split in bands of at least this many output pixels, one
+	// per active resize worker at most
+	size_t min_band_pixels = size_t(1) << 20;
+	size_t decode_cache_bytes = size_t(512) << 20;
+	// image sizes, page types and decode times are kept across runs in this
+	// file, default_metadata_path() if empty, for up to metadata_slots
+	// images. 0 for none
+	std::string metadata_path;
+	size_t metadata_slots = size_t(1) << 16;
+	// estimated bytes of file data and pixels held by jobs between reading
+	// and upload. Requests wait for room before being decoded, except the
+	// visible ones (priority 0). One job is always let through
+	size_t in_flight_budget = size_t(1) << 30;
+	// freed pixel buffers kept for reuse, all given back when memory is low
+	size_t retained_buffer_bytes = size_t(256) << 20;
+	double low_memory_fraction = 0.1;
+	// resized pages bigger than a slot, or done while all slots are taken,
+	// are uploaded from regular memory
+	int staging_slots = 4;
+	size_t staging_slot_bytes = size_t(32) << 20;
+	// hidden windows sharing the main context, one upload thread each
+	unsigned int upload_contexts = 1;
+};
 
-	// change to greyscale column major
-	std::vector<uint8_t> pixels_cm;
-	pixels_cm.reserve(w * h);
-	for (int x = 0; x < w; x++) {
-		for (int y = 0; y < h; y++) {
-			const uint8_t *pixel = pixels + (x + w * y) * 4;
-			pixels_cm.push_back((pixel[0] + pixel[1] + pixel[2]) / 3);
+class texture_load_pool {
+  private:
+	loader_config config;
+	std::vector<std::jthread> worker_threads;
+	std::vector<GLFWwindow *> load_windows;
+	std::vector<GLuint> null_vaos; // vertex arrays aren't shared
+	shader_program program;
+
+	struct request {
+		int image_index;
+		std::string path;
+		glm::ivec2 size; // {0, 0} requests the image size and type
+		int priority;	 // lower is served first
+		uint64_t seq;
+		cancel_flag cancel; // only for textures
+		std::chrono::steady_clock::time_point requested;
+
+		bool cancelled() const { return cancel && *cancel; }
+	};
+
+	// part of the in-flight budget, given back when the job is dropped
+	class in_flight_claim {
+	  private:
+		texture_load_pool *pool = nullptr;
+		size_t bytes = 0;
+
+	  public:
+		in_flight_claim() = default;
+		in_flight_claim(texture_load_pool *pool, size_t bytes)
+			: pool(pool), bytes(bytes) {}
+		in_flight_claim(const in_flight_claim &) = delete;
+		in_flight_claim &operator=(in_flight_claim &&other) {
+			std::swap(pool, other.pool);
+			std::swap(bytes, other.bytes);
+			return *this;
 		}
-	}
-	int depth = 0;
-	int page_type = 3;
+		~in_flight_claim() {
+			if (pool)
+				pool->release_in_flight(bytes);
+		}
+	};
+
+	// a request on its way through the read, decode, resize and upload stages
+	struct load_job {
+		in_flight_claim claim; // released last
+		size_t footprint = 0;  // estimated from the image header
+		request req;
+		// the decode if it was cached when the job started, so the file
+		// isn't read and the decode isn't counted in the footprint
+		std::shared_future<shared_image> cached;
+		pooled_buffer file;
+		shared_mapping mapping; // instead of file for big files
+		int scale_denom = 1;	// JPEGs much bigger than req.size
+		// false for type requests no texture is waiting on
+		bool keep_decode = true;
+		shared_image image;
+		// image resized to req.size, in the staging slot if there is one
+		int slot = -1;
+		pooled_buffer pixels;
+	};
+	using job_ptr = std::unique_ptr<load_job>;
+
+	// guards requests and in_flight_bytes, declared before the queues so
+	// jobs still queued at destruction can give their claims back
+	std::mutex mutex;
+	std::condition_variable_any cv;
+
+	// binary heap, requests.front() is the next request to be served
+	std::vector<request> requests;
+	uint64_t next_seq = 0;
+	size_t in_flight_bytes = 0;
+	// per reader, the job waiting for room in the in-flight budget.
+	// Visible requests go past it, and so does the job once it's visible
+	std::vector<job_ptr> held_jobs;
+
+	// a resize split in bands of rows, the last band done passes the job on
+	struct banded_resize {
+		job_ptr job;
+		pooled_buffer shrunk; // source after the box prefilter, if any
+		const uint8_t *src;
+		glm::ivec2 src_size;
+		uint8_t *out;
+		int bands;
+		std::atomic<int> bands_left;
+		std::chrono::steady_clock::time_point start;
+	};
 
-	unsigned int var_left = 0, var_right = 0;
+	// a job to be resized, or a band of one already split
+	struct resize_task {
+		job_ptr job;
+		std::shared_ptr<banded_resize> resize;
+		int y0 = 0, y1 = 0;
+	};
 
-	while (page_type == 3 && depth++ < 20) {
-		unsigned int color_left = 0, color_right = 0;
-		color_left = std::accumulate(pixels_cm.begin() + h * depth,
-									 pixels_cm.begin() + h * (depth + 1), 0);
-		color_right = std::accumulate(pixels_cm.end() - h * (depth + 1),
-									  pixels_cm.end() - h * depth, 0);
+	bounded_queue<job_ptr> read_queue, decode_queue, upload_queue;
+	bounded_queue<resize_task> resize_queue;
 
-		color_left = color_left / h;
-		color_right = color_right / h;
+	struct probe {
+		int image_index;
+		std::string path;
+	};
+	bounded_queue<std::vector<probe>> probe_queue;
+	stage_control decode_control, resize_control;
+	std::atomic<int> priority_limit = std::numeric_limits<int>::max();
 
-		unsigned int accum = 0;
-		std::for_each(pixels_cm.begin(), pixels_cm.begin() + h,
-					  [&](unsigned int d) {
-						  accum += (d - color_left) * (d - color_left);
-					  });
-		var_left = std::max(var_left, accum / h);
+	std::atomic<int> live_texture_count = 0;
 
-		accum = 0;
-		std::for_each(pixels_cm.end() - h, pixels_cm.end(),
-					  [&](unsigned int d) {
-						  accum += (d - color_right) * (d - color_right);
-					  });
-		var_right = std::max(var_right, accum / h);
+	// per stage durations and counts for stats()
+	latency_histogram read_latency, decode_latency, resize_latency,
+		upload_latency, total_latency;
+	std::atomic<uint64_t> completed_count = 0, cancelled_count = 0;
 
-		page_type = ((var_right < 500) << 1) | (var_left < 500);
+	decode_cache decoded;
+	mapping_cache mappings;
+	metadata_cache metadata;
+	pbo_ring staging;
+
+	struct completion {
+		load_completion result;
+		GLsync fence = nullptr; // textures are handed over once it signals
+		cancel_flag cancel;
+		std::chrono::steady_clock::time_point requested;
+	};
+	completion_queue<completion> completions;
+	std::vector<completion> unsignalled; // main thread only
+
+	void complete(int image_index, completion_kind kind, glm::ivec2 size,
+				  int image_type = 0) {
+		completions.push({{kind, image_index, size, image_type}});
 	}
 
-	if (page_type == 3)
-		page_type = 0;
-	return page_type;
-}
+	static bool request_after(const request &a, const request &b) {
+		if (a.priority != b.priority)
+			return a.priority > b.priority;
+		return a.seq > b.seq;
+	}
 
-template <typename T> class lazy_load {
-  private:
-	std::future<T> future;
-	T result;
+	void push_request(request &&req) {
+		req.seq = next_seq++;
+		req.requested = std::chrono::steady_clock::now();
+		requests.push_back(std::move(req));
+		std::push_heap(requests.begin(), requests.end(), request_after);
+		cv.notify_one();
+	}
 
-	bool unset = false;
+	bool fits_in_flight(size_t bytes) const {
+		return in_flight_bytes == 0 ||
+			   in_flight_bytes + bytes <= config.in_flight_budget;
+	}
 
-  public:
-	lazy_load(std::future<T> &&fut) : future(std::move(fut)) {}
-	lazy_load() : unset(true) {}
+	void release_in_flight(size_t bytes) {
+		{
+			std::scoped_lock lk(mutex);
+			in_flight_bytes -= bytes;
+		}
+		cv.notify_all();
+	}
 
-	const T &get() {
-		if (future.valid())
-			result = future.get();
-		return result;
+	// from the header alone when the format allows it
+	static glm::ivec2 image_size(const std::string &path,
+								 const shared_mapping &mapping) {
+		glm::ivec2 size(0, 0);
+		if (mapping) {
+			const uint8_t *data = mapping->data();
+			if (auto probed = probe_image_size(data, mapping->size()))
+				return *probed;
+			stbi_info_from_memory(data, mapping->size(), &size.x, &size.y,
+								  nullptr);
+			return size;
+		}
+
+		if (auto probed = probe_image_size(path))
+			return *probed;
+		stbi_info(path.c_str(), &size.x, &size.y, nullptr);
+		return size;
 	}
 
-	const T &get_or(const T &alt) {
-		if (!ready())
-			return alt;
-		return get();
+	// reduced size decodes are cached apart from the full size ones
+	static std::string decode_key(const std::string &path, int scale_denom) {
+		if (scale_denom == 1)
+			return path;
+		return path + "@1/" + std::to_string(scale_denom);
+	}
+	static std::string decode_key(const load_job &job) {
+		return decode_key(job.req.path, job.scale_denom);
 	}
 
-	bool ready() const {
-		return !unset &&
-			   (!future.valid() ||
-				(future.valid() && future.wait_for(std::chrono::seconds(0)) ==
-									   std::future_status::ready));
+	static shared_image decode(const load_job &job) {
+		const uint8_t *data = job.file.data();
+		size_t len = job.file.size();
+		if (job.mapping) {
+			data = job.mapping->data();
+			len = job.mapping->size();
+		}
+
+		glm::ivec2 size;
+#ifdef USE_LIBJPEG
+		if (job.scale_denom != 1 && len != 0)
+			if (uint8_t *pixels =
+					decode_jpeg_scaled(data, len, job.scale_denom, size))
+				return std::make_shared<decoded_image>(pixels, size);
+#endif
+		uint8_t *pixels =
+			len == 0
+				? stbi_load(job.req.path.c_str(), &size.x, &size.y, nullptr, 4)
+				: stbi_load_from_memory(data, len, &size.x, &size.y, nullptr,
+										4);
+		return pixels ? std::make_shared<decoded_image>(pixels, size)
+					  : nullptr;
 	}
 
-	bool has_value() const { return !unset; }
-};
+	// through the decode cache, timing full size decodes for the metadata
+	// cache
+	shared_image decode_cached(const load_job &job) {
+		auto timed_decode = [this, &job] {
+			auto start = std::chrono::steady_clock::now();
+			shared_image image = decode(job);
+			if (image && job.scale_denom == 1) {
+				auto took = std::chrono::steady_clock::now() - start;
+				metadata.update(job.req.path, [took](image_metadata &meta) {
+					using namespace std::chrono;
+					meta.decode_us = duration_cast<microseconds>(took).count();
+				});
+			}
+			return image;
+		};
+		return decoded.get(decode_key(job), timed_decode, job.keep_decode);
+	}
 
-class texture_load_pool {
-  private:
-	std::vector<std::jthread> worker_threads;
-	GLFWwindow *load_window;
-	shader_program program;
-	GLuint nullVAO;
+	// biggest texture of path requested and not served yet, 0 if none
+	glm::ivec2 waiting_texture_size(const std::string &path) {
+		std::scoped_lock lk(mutex);
+		glm::ivec2 size(0, 0);
+		for (const auto &req : requests)
+			if (req.size.x != 0 && !req.cancelled() && req.path == path)
+				size = {std::max(size.x, req.size.x),
+						std::max(size.y, req.size.y)};
+		return size;
+	}
 
-	using req_type = std::tuple<std::string, glm::ivec2, std::promise<GLuint>,
-								std::promise<glm::ivec2>, std::promise<int>>;
+	// answers what the header can answer and estimates the job's footprint
+	// from it, mapping big files. false if the job is already done
+	bool prepare_job(load_job &job) {
+		request &req = job.req;
+		job.cached = decoded.find(req.path);
+		glm::ivec2 size(0, 0);
+		size_t file_bytes = 0;
+		if (req.size.x == 0 || !job.cached.valid()) {
+			std::error_code ec;
+			file_bytes = std::filesystem::file_size(req.path, ec);
+			if (ec)
+				file_bytes = 0;
+			if (config.mmap_bytes != 0 && file_bytes >= config.mmap_bytes &&
+				(config.direct_io_bytes == 0 ||
+				 file_bytes < config.direct_io_bytes))
+				job.mapping = mappings.get(req.path);
+			size = image_size(req.path, job.mapping);
+		}
 
-	std::deque<req_type> requests;
+		if (req.size.x == 0) {
+			// unreadable files keep the placeholder size
+			bool wide = size.x > size.y * 0.8;
+			if (size.x != 0) {
+				complete(req.image_index, completion_kind::image_size, size);
+				metadata.update(req.path, [&](image_metadata &meta) {
+					meta.size = size;
+					if (wide)
+						meta.image_type = 3;
+				});
+			}
+			if (wide) {
+				complete(req.image_index, completion_kind::image_type, size,
+						 3);
+				return false;
+			}
+		}
 
-	std::mutex context_mutex;
-	std::mutex mutex;
-	std::condition_variable cv;
+		// pages are classified from a full size decode, kept for a texture
+		// waiting on the page so it's decoded once
+		if (req.size.x == 0)
+			job.keep_decode = waiting_texture_size(req.path).x != 0;
 
-	void loader(std::stop_token stop) {
-		avir::CLancIR resizer;
+		if (!job.cached.valid() && req.size.x != 0 &&
+			has_jpeg_extension(req.path)) {
+			job.scale_denom = jpeg_scale_denom(size, req.size);
+			// any cached decode at least that big will do
+			for (int denom = job.scale_denom; denom > 1; denom /= 2)
+				if (auto cached = decoded.find(decode_key(req.path, denom));
+					cached.valid()) {
+					job.scale_denom = denom;
+					job.cached = std::move(cached);
+					break;
+				}
+		}
+
+		if (!job.cached.valid()) {
+			int denom = job.scale_denom;
+			size_t decode_bytes = size_t((size.x + denom - 1) / denom) *
+								  ((size.y + denom - 1) / denom) * 4;
+			job.footprint += file_bytes + decode_bytes;
+		} else
+			job.mapping.reset();
+		job.footprint += size_t(req.size.x) * req.size.y * 4;
+		return true;
+	}
+
+	void reader(std::stop_token stop, unsigned int worker) {
+		job_ptr &held = held_jobs[worker];
 
 		while (true) {
 			std::unique_lock lk(mutex);
-			if (requests.empty())
-				cv.wait(lk, [this, &stop] {
-					return !requests.empty() || stop.stop_requested();
-				});
-			if (stop.stop_requested())
+			auto visible_next = [this] {
+				return !requests.empty() && requests.front().priority == 0;
+			};
+			if (!cv.wait(lk, stop, [&] {
+					if (held)
+						return visible_next() || held->req.cancelled() ||
+							   held->req.priority == 0 ||
+							   fits_in_flight(held->footprint);
+					return !requests.empty() &&
+						   requests.front().priority <= priority_limit;
+				}))
 				return;
 
-			auto [req_path, req_size, texture_pr, size_pr, type_pr] =
-				std::move(requests.back());
-			requests.pop_back();
+			job_ptr job;
+			if (held && !visible_next())
+				job = std::move(held);
+			else {
+				std::pop_heap(requests.begin(), requests.end(),
+							  request_after);
+				job = std::make_unique<load_job>();
+				job->req = std::move(requests.back());
+				requests.pop_back();
+				lk.unlock();
+
+				if (job->req.cancelled() || !prepare_job(*job))
+					continue;
+				lk.lock();
+			}
+
+			if (job->req.cancelled())
+				continue;
+			if (job->req.priority != 0 && !fits_in_flight(job->footprint)) {
+				held = std::move(job);
+				continue;
+			}
+			in_flight_bytes += job->footprint;
+			job->claim = in_flight_claim(this, job->footprint);
 			lk.unlock();
 
-			glm::ivec2 size;
-			if (req_size.x == 0) {
-				FILE *f = stbi__fopen(req_path.c_str(), "rb");
-				stbi_info_from_file(f, &size.x, &size.y, nullptr);
-				size_pr.set_value(size);
-
-				if (size.x > size.y * 0.8)
-					type_pr.set_value(3);
-				else {
-					uint8_t *pixels =
-						stbi_load_from_file(f, &size.x, &size.y, nullptr, 4);
-					type_pr.set_value(compute_image_type(pixels, size));
-					stbi_image_free(pixels);
+			auto &queue =
+				job->cached.valid() || job->mapping ? decode_queue : read_queue;
+			if (!queue.push(std::move(job), stop))
+				return;
+		}
+	}
+
+	// reads the files of jobs whose decode isn't cached
+	void file_reader(std::stop_token stop, unsigned int) {
+#ifdef USE_IO_URING
+		read_ring ring;
+		if (ring.init(config.io_depth)) {
+			uring_file_reader(stop, ring);
+			return;
+		}
+#endif
+		while (auto next = read_queue.pop(stop)) {
+			load_job &job = **next;
+			if (job.req.cancelled())
+				continue;
+
+			auto start = std::chrono::steady_clock::now();
+			job.file = read_file(job.req.path, config.direct_io_bytes);
+			read_latency.record_since(start);
+			if (!decode_queue.push(std::move(*next), stop))
+				return;
+		}
+	}
+
+#ifdef USE_IO_URING
+	// keeps up to io_depth reads in flight, only sleeping on the read queue
+	// while there are none
+	void uring_file_reader(std::stop_token stop, read_ring &ring) {
+		struct pending_read {
+			job_ptr job;
+			file_read read;
+			std::chrono::steady_clock::time_point start;
+		};
+		std::vector<std::unique_ptr<pending_read>> in_flight;
+
+		auto finish = [&](pending_read *done) {
+			auto it = std::find_if(in_flight.begin(), in_flight.end(),
+								   [done](auto &p) { return p.get() == done; });
+			auto job = std::move((*it)->job);
+			job->file = (*it)->read.finish();
+			read_latency.record_since((*it)->start);
+			in_flight.erase(it);
+			return job;
+		};
+
+		while (true) {
+			while (in_flight.size() < config.io_depth) {
+				using namespace std::chrono_literals;
+				auto next = in_flight.empty()
+								? read_queue.pop(stop)
+								: read_queue.pop(stop, 0ms);
+				if (!next)
+					break;
+				if ((*next)->req.cancelled())
+					continue;
+
+				auto pending = std::make_unique<pending_read>();
+				pending->job = std::move(*next);
+				pending->start = std::chrono::steady_clock::now();
+				if (!pending->read.open(pending->job->req.path,
+										config.direct_io_bytes)) {
+					// decode() goes to the file itself and reports failure
+					if (!decode_queue.push(std::move(pending->job), stop))
+						break;
+					continue;
 				}
-				fclose(f);
-			} else {
-				uint8_t *pixels =
-					stbi_load(req_path.c_str(), &size.x, &size.y, nullptr, 4);
-				std::vector<uint8_t> resized_pixels(req_size.x * req_size.y *
-													4);
-				resizer.resizeImage(pixels, size.x, size.y,
-									resized_pixels.data(), req_size.x,
-									req_size.y, 4);
-
-				std::scoped_lock lk(context_mutex);
-				glfwMakeContextCurrent(load_window);
-				GLuint tex;
-				glCreateTextures(GL_TEXTURE_2D, 1, &tex);
-				glTextureParameteri(tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-				glTextureParameteri(tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-				glTextureParameteri(tex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-				glTextureParameteri(tex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-				glTextureStorage2D(tex, 1, GL_RGBA8, req_size.x, req_size.y);
+				ring.submit(pending->read, pending.get());
+				in_flight.push_back(std::move(pending));
+			}
+
+			if (stop.stop_requested()) {
+				// the kernel still writes into the buffers
+				while (!in_flight.empty())
+					finish(static_cast<pending_read *>(ring.wait().first));
+				return;
+			}
+			if (in_flight.empty())
+				continue;
+
+			auto [tag, result] = ring.wait();
+			auto done = static_cast<pending_read *>(tag);
+			if (!done->read.advance(result)) {
+				ring.submit(done->read, done);
+				continue;
+			}
+			decode_queue.push(finish(done), stop);
+		}
+	}
+#endif
+
+	void decoder(std::stop_token stop, unsigned int worker) {
+		while (decode_control.wait_active(worker, stop)) {
+			auto next = decode_queue.pop(stop);
+			if (!next)
+				return;
+
+			load_job &job = **next;
+			if (job.req.cancelled())
+				continue;
+
+			auto timer = decode_control.time_job();
+
+			// the decode is kept for later loads at other sizes, and for the
+			// texture load following a type request
+			auto start = std::chrono::steady_clock::now();
+			job.image =
+				job.cached.valid() ? job.cached.get() : decode_cached(job);
+			job.cached = {};
+			int image_type =
+				job.req.size.x == 0 && job.image
+					? compute_image_type(job.image->pixels, job.image->size)
+					: 0;
+			job.file = {};
+			job.mapping.reset();
+			decode_latency.record_since(start);
+
+			if (job.req.size.x == 0) {
+				complete(job.req.image_index, completion_kind::image_type,
+						 job.req.size, image_type);
+				if (job.image)
+					metadata.update(job.req.path, [&](image_metadata &meta) {
+						meta.image_type = image_type;
+					});
+				continue;
+			}
+
+			timer.finish();
+			if (!resize_queue.push({std::move(*next)}, stop))
+				return;
+		}
+	}
+
+	// gets the job's output ready, prefilters its image and splits the
+	// resize in bands, queueing all but the first. Empty if the job was
+	// cancelled
+	std::shared_ptr<banded_resize> start_resize(job_ptr &&job) {
+		if (job->req.cancelled())
+			return nullptr;
+
+		glm::ivec2 req_size = job->req.size;
+		size_t bytes = size_t(req_size.x) * req_size.y * 4;
+		job->slot = staging.try_acquire(bytes);
+
+		auto resize = std::make_shared<banded_resize>();
+		resize->start = std::chrono::steady_clock::now();
+		if (job->slot != -1)
+			resize->out = staging.data(job->slot);
+		else {
+			job->pixels = pooled_buffer(bytes);
+			resize->out = job->pixels.data();
+		}
+
+		if (!job->image) {
+			std::fill_n(resize->out, bytes, 0);
+			resize->job = std::move(job);
+			resize->bands = resize->bands_left = 1;
+			return resize;
+		}
+
+		resize->src = job->image->pixels;
+		resize->src_size = job->image->size;
+		while (config.box_prefilter && resize->src_size.x > 2 * req_size.x &&
+			   resize->src_size.y > 2 * req_size.y) {
+			glm::ivec2 half = resize->src_size / 2;
+			pooled_buffer next(size_t(half.x) * half.y * 4);
+			if (next.empty())
+				break;
+			box_shrink(resize->src, resize->src_size.x, resize->src_size.y,
+					   next.data());
+			resize->shrunk = std::move(next);
+			resize->src = resize->shrunk.data();
+			resize->src_size = half;
+		}
+		resize->job = std::move(job);
+
+		size_t pixels = size_t(req_size.x) * req_size.y;
+		int n_bands = std::clamp<size_t>(pixels / config.min_band_pixels, 1,
+										 resize_control.active_workers());
+		resize->bands = resize->bands_left = n_bands;
+		for (int i = 1; i < n_bands; ++i)
+			resize_queue.push_now({nullptr, resize, req_size.y * i / n_bands,
+								   req_size.y * (i + 1) / n_bands});
+		return resize;
+	}
+
+	void resizer(std::stop_token stop, unsigned int worker) {
+		avir::CLancIR resizer;
+
+		while (resize_control.wait_active(worker, stop)) {
+			auto next = resize_queue.pop(stop);
+			if (!next)
+				return;
+
+			auto timer = resize_control.time_job();
+			auto resize = std::move(next->resize);
+			int y0 = next->y0, y1 = next->y1;
+			if (!resize) {
+				resize = start_resize(std::move(next->job));
+				if (!resize)
+					continue;
+				y0 = 0;
+				y1 = resize->job->req.size.y / resize->bands;
+			}
+
+			load_job &job = *resize->job;
+			glm::ivec2 req_size = job.req.size;
+			if (job.image && !job.req.cancelled()) {
+				// the full source with the offset and step of the whole
+				// resize keeps the bands seamless
+				double ky = double(resize->src_size.y) / req_size.y;
+				avir::CLancIRParams params(0, 0, 0.0, ky, 0.0, y0 * ky);
+				resizer.resizeImage(resize->src, resize->src_size.x,
+									resize->src_size.y,
+									resize->out + size_t(y0) * req_size.x * 4,
+									req_size.x, y1 - y0, 4, &params);
+			}
+			timer.finish();
+
+			if (--resize->bands_left > 0)
+				continue;
+			job.image.reset();
+			resize_latency.record_since(resize->start);
+			if (!upload_queue.push(std::move(resize->job), stop))
+				return;
+		}
+	}
+
+	// sizes the decode and resize stages to their backlog, within the cores
+	// the rest of the system leaves free, and holds prefetching back while
+	// there are none. Also trims the buffer pool when memory gets low
+	void governor(std::stop_token stop) {
+		using namespace std::chrono;
+		const double cores = std::max(std::thread::hardware_concurrency(), 1u);
+		const double interval_ns =
+			duration_cast<nanoseconds>(config.governor_interval).count();
+
+		others_load_meter others;
+		others.sample();
+
+		std::mutex sleep_mutex;
+		std::condition_variable_any sleep_cv;
+		while (true) {
+			std::unique_lock sleep_lk(sleep_mutex);
+			sleep_cv.wait_for(sleep_lk, stop, config.governor_interval,
+							  [] { return false; });
+			if (stop.stop_requested())
+				return;
+
+			size_t queued;
+			{
+				std::scoped_lock lk(mutex);
+				queued = requests.size();
+			}
+			double decode_job_ns = decode_control.collect();
+			double resize_job_ns = resize_control.collect();
+
+			double others_load = others.sample();
+			double spare_cores = std::floor(std::max(cores - others_load, 0.0));
+
+			auto wanted = [&](size_t backlog, double job_ns,
+							  unsigned int max_workers) {
+				double min = config.min_active_workers;
+				double max = std::max<double>(max_workers, min);
+				// enough to get through the backlog within one interval
+				double needed = job_ns == 0.0
+									? backlog
+									: std::ceil(backlog * job_ns / interval_ns);
+				return static_cast<unsigned int>(std::clamp(
+					needed, min, std::clamp(spare_cores, min, max)));
+			};
+			decode_control.set_active(
+				wanted(queued + read_queue.size() + decode_queue.size(),
+					   decode_job_ns, config.decode_threads));
+			resize_control.set_active(
+				wanted(decode_queue.size() + resize_queue.size(),
+					   resize_job_ns, config.resize_threads));
+
+			// less than one core left, at least half a core for one core
+			int limit = others_load >= std::max(cores - 1, 0.5)
+							? config.busy_priority_limit
+							: std::numeric_limits<int>::max();
+			if (priority_limit.exchange(limit) != limit) {
+				std::scoped_lock lk(mutex);
+				cv.notify_all();
+			}
+
+			if (read_available_memory() < config.low_memory_fraction)
+				buffer_pool::instance().trim();
+		}
+	}
+
+	void prober(std::stop_token stop, unsigned int) {
+		while (auto batch = probe_queue.pop(stop))
+			for (const auto &[image_index, path] : *batch) {
+				glm::ivec2 size = image_size(path, nullptr);
+				if (size.x == 0)
+					continue; // the placeholder size stays
+				complete(image_index, completion_kind::image_size, size);
+				metadata.update(path, [size](image_metadata &meta) {
+					meta.size = size;
+				});
+			}
+	}
+
+	// the only thread using load_windows[context] after init
+	void uploader(std::stop_token stop, unsigned int context) {
+		glfwMakeContextCurrent(load_windows[context]);
+
+		while (!stop.stop_requested()) {
+			// wake up now and then to hand staging slots back to resizers
+			using namespace std::chrono_literals;
+			auto next = staging.busy() ? upload_queue.pop(stop, 1ms)
+									   : upload_queue.pop(stop);
+			staging.reclaim();
+			if (!next)
+				continue;
+
+			load_job &job = **next;
+			if (job.req.cancelled()) {
+				if (job.slot != -1)
+					staging.release(job.slot);
+				continue;
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			glm::ivec2 req_size = job.req.size;
+			GLuint tex;
+			glCreateTextures(GL_TEXTURE_2D, 1, &tex);
+			live_texture_count++;
+			glTextureParameteri(tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTextureParameteri(tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTextureParameteri(tex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTextureParameteri(tex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTextureStorage2D(tex, 1, GL_RGBA8, req_size.x, req_size.y);
+			if (job.slot != -1) {
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.id());
 				glTextureSubImage2D(tex, 0, 0, 0, req_size.x, req_size.y,
 									GL_RGBA, GL_UNSIGNED_BYTE,
-									resized_pixels.data());
-				glBindTextureUnit(0, tex);
-				glDrawArrays(GL_TRIANGLES, 0, 3);
-				glFinish();
-				texture_pr.set_value(tex);
-				glfwMakeContextCurrent(nullptr);
-				stbi_image_free(pixels);
-			}
+									staging.offset(job.slot));
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				staging.retire(job.slot);
+			} else
+				glTextureSubImage2D(tex, 0, 0, 0, req_size.x, req_size.y,
+									GL_RGBA, GL_UNSIGNED_BYTE,
+									job.pixels.data());
+			glBindTextureUnit(0, tex);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+
+			GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glFlush();
+			upload_latency.record_since(start);
+
+			completions.push({{completion_kind::texture,
+							   job.req.image_index, req_size, 0, tex},
+							  fence,
+							  std::move(job.req.cancel),
+							  job.req.requested});
 		}
+
+		glfwMakeContextCurrent(nullptr);
 	}
 
   public:
-	void init(GLFWwindow *load_window, unsigned int n_workers) {
-		this->load_window = load_window;
-		for (int i = 0; i < n_workers; ++i)
-			worker_threads.emplace_back(
-				[this](std::stop_token s) { loader(s); });
+	// creates the upload contexts, sharing objects with main_window
+	void init(GLFWwindow *main_window, const loader_config &config) {
+		this->config = config;
+		decode_control.set_active(std::max(config.decode_threads, 1u));
+		resize_control.set_active(std::max(config.resize_threads, 1u));
+		decoded.set_budget(config.decode_cache_bytes);
+		mappings.set_max_entries(config.mapped_files);
+		metadata.open(config.metadata_path.empty() ? default_metadata_path()
+												   : config.metadata_path,
+					  config.metadata_slots);
+		buffer_pool::instance().set_retain_limit(config.retained_buffer_bytes);
+		unsigned int n_uploaders = std::max(config.upload_contexts, 1u);
+		size_t read_capacity =
+			std::max<size_t>(config.io_depth, config.queue_capacity);
+		read_queue.set_capacity(read_capacity);
+		decode_queue.set_capacity(config.queue_capacity);
+		resize_queue.set_capacity(config.queue_capacity);
+		upload_queue.set_capacity(config.queue_capacity);
+		// probe_sizes() must never block the main thread
+		probe_queue.set_capacity(std::numeric_limits<size_t>::max());
 
 		const std::string vert_shader = R"(
 #version 460 core
@@ -210,44 +878,190 @@ void main()
     frag_color = texture(tex, fs_texcoords);
 })";
 		GLFWwindow *prev_context = glfwGetCurrentContext();
-		glfwMakeContextCurrent(load_window);
-		glCreateVertexArrays(1, &nullVAO);
-		glBindVertexArray(nullVAO);
-		program.init(vert_shader, frag_shader);
-		program.use();
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		for (unsigned int i = 0; i < n_uploaders; ++i) {
+			GLFWwindow *load_window =
+				glfwCreateWindow(1, 1, "load window", nullptr, main_window);
+			glfwMakeContextCurrent(load_window);
+			if (i == 0) {
+				program.init(vert_shader, frag_shader);
+				staging.init(config.staging_slots, config.staging_slot_bytes);
+			}
+
+			GLuint null_vao;
+			glCreateVertexArrays(1, &null_vao);
+			glBindVertexArray(null_vao);
+			program.use();
+
+			load_windows.push_back(load_window);
+			null_vaos.push_back(null_vao);
+		}
 		glfwMakeContextCurrent(prev_context);
+
+		auto start_stage = [this](unsigned int n_threads, auto stage) {
+			for (unsigned int i = 0; i < std::max(n_threads, 1u); ++i)
+				worker_threads.emplace_back(
+					[this, stage, i](std::stop_token s) {
+						(this->*stage)(s, i);
+					});
+		};
+		held_jobs.resize(std::max(config.read_threads, 1u));
+		start_stage(config.read_threads, &texture_load_pool::reader);
+		start_stage(config.io_threads, &texture_load_pool::file_reader);
+		start_stage(config.probe_threads, &texture_load_pool::prober);
+		start_stage(config.decode_threads, &texture_load_pool::decoder);
+		start_stage(config.resize_threads, &texture_load_pool::resizer);
+		start_stage(n_uploaders, &texture_load_pool::uploader);
+		worker_threads.emplace_back(
+			[this](std::stop_token s) { governor(s); });
 	}
 
 	void destroy() {
+		// jthread destructors request stop and join
+		worker_threads.clear();
+
 		GLFWwindow *prev_context = glfwGetCurrentContext();
-		glfwMakeContextCurrent(load_window);
-		glDeleteVertexArrays(1, &nullVAO);
+		for (int i = 0; i < load_windows.size(); ++i) {
+			glfwMakeContextCurrent(load_windows[i]);
+			glDeleteVertexArrays(1, &null_vaos[i]);
+		}
+
 		program.destroy();
+		staging.destroy();
+		completions.drain(
+			[this](completion &&done) {
+				unsignalled.push_back(std::move(done));
+			});
+		for (auto &done : unsignalled)
+			if (done.fence) {
+				glDeleteSync(done.fence);
+				glDeleteTextures(1, &done.result.texture);
+				live_texture_count--;
+			}
+		unsignalled.clear();
 		glfwMakeContextCurrent(prev_context);
 
-		for (auto &worker : worker_threads)
-			worker.request_stop();
-		cv.notify_all();
+		for (auto load_window : load_windows)
+			glfwDestroyWindow(load_window);
+		load_windows.clear();
+		null_vaos.clear();
 	}
 
-	auto load_texture(const std::string &path, glm::ivec2 size) {
+	texture_handle load_texture(int image_index, const std::string &path,
+								glm::ivec2 size, int priority) {
+		auto cancel = std::make_shared<std::atomic<bool>>(false);
 		std::scoped_lock lk(mutex);
-		auto &request = requests.emplace_back(
-			path, size, std::promise<GLuint>(), std::promise<glm::ivec2>(),
-			std::promise<int>());
-		cv.notify_one();
+		push_request({image_index, path, size, priority, 0, cancel});
+		return {0, cancel};
+	}
+
+	// calls handle(const load_completion &) for the sizes and types found
+	// and the textures uploaded since the last call. Textures released
+	// meanwhile are deleted instead. Call once per frame from the main
+	// thread, with the main context current
+	template <typename F> void drain_completions(F &&handle) {
+		completions.drain([&](completion &&done) {
+			if (done.fence)
+				unsignalled.push_back(std::move(done));
+			else
+				handle(done.result);
+		});
+
+		std::erase_if(unsignalled, [&](completion &up) {
+			if (glClientWaitSync(up.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+				return false;
+
+			glDeleteSync(up.fence);
+			if (*up.cancel) {
+				glDeleteTextures(1, &up.result.texture);
+				live_texture_count--;
+				return true;
+			}
+			completed_count++;
+			total_latency.record_since(up.requested);
+			handle(up.result);
+			return true;
+		});
+	}
+
+	// deletes the texture, or makes sure that it gets deleted once loaded.
+	// Needs the main context current
+	void release_texture(texture_handle &texture) {
+		if (texture.tex) {
+			glDeleteTextures(1, &texture.tex);
+			live_texture_count--;
+		} else if (texture.cancelled) {
+			*texture.cancelled = true;
+			cancelled_count++;
+		}
+		texture = {};
+	}
 
-		return std::get<2>(request).get_future();
+	int live_textures() const { return live_texture_count; }
+
+	// queue depths, texture counts and latency quantiles (in microseconds,
+	// total is from request to delivery) as one line of key:value pairs
+	std::string stats() {
+		std::ostringstream out;
+		{
+			std::scoped_lock lk(mutex);
+			out << "queued:" << requests.size()
+				<< ",in_flight_bytes:" << in_flight_bytes;
+		}
+		out << ",read_queue:" << read_queue.size()
+			<< ",decode_queue:" << decode_queue.size()
+			<< ",resize_queue:" << resize_queue.size()
+			<< ",upload_queue:" << upload_queue.size()
+			<< ",upload_threads:" << std::max(config.upload_contexts, 1u)
+			<< ",completed:" << completed_count
+			<< ",cancelled:" << cancelled_count;
+
+		std::pair<const char *, const latency_histogram &> histograms[] = {
+			{"read", read_latency},		{"decode", decode_latency},
+			{"resize", resize_latency}, {"upload", upload_latency},
+			{"total", total_latency}};
+		for (auto &[name, histogram] : histograms)
+			for (int p : {50, 90, 99})
+				out << ',' << name << "_p" << p << "_us:"
+					<< histogram.quantile_us(p / 100.0);
+		return out.str();
+	}
+
+	// sizes of many images at once, arriving through drain_completions()
+	void probe_sizes(const std::vector<std::pair<int, std::string>> &images) {
+		for (size_t i = 0; i < images.size(); i += config.probe_batch) {
+			std::vector<probe> batch;
+			for (size_t j = i;
+				 j < std::min(i + config.probe_batch, images.size()); ++j)
+				batch.push_back({images[j].first, images[j].second});
+			probe_queue.push(std::move(batch), {});
+		}
 	}
 
-	auto get_size_type(const std::string &path) {
+	// what earlier runs learned about the file, if it hasn't changed since
+	std::optional<image_metadata> cached_metadata(const std::string &path) {
+		return metadata.get(path);
+	}
+
+	// the image size and then the type arrive through drain_completions()
+	void get_size_type(int image_index, const std::string &path,
+					   int priority) {
 		std::scoped_lock lk(mutex);
-		auto &request = requests.emplace_front(
-			path, glm::ivec2(0, 0), std::promise<GLuint>(),
-			std::promise<glm::ivec2>(), std::promise<int>());
-		cv.notify_one();
+		push_request({image_index, path, glm::ivec2(0, 0), priority});
+	}
 
-		return std::pair{std::get<3>(request).get_future(),
-						 std::get<4>(request).get_future()};
+	// priority_of(image_index, is_size_request) -> new priority
+	template <typename F> void reprioritize(F &&priority_of) {
+		std::scoped_lock lk(mutex);
+		std::erase_if(requests,
+					  [](const request &req) { return req.cancelled(); });
+		for (auto &req : requests)
+			req.priority = priority_of(req.image_index, req.size.x == 0);
+		std::make_heap(requests.begin(), requests.end(), request_after);
+		for (auto &held : held_jobs)
+			if (held)
+				held->req.priority =
+					priority_of(held->req.image_index, held->req.size.x == 0);
+		cv.notify_all(); // held jobs may have been cancelled or be visible
 	}
 };
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// whole file mapped read only, for decoding straight from the page cache
+class mapped_file {
+  public:
+	// which file, and which version of it, a mapping was made from
+	struct identity {
+		dev_t device = 0;
+		ino_t inode = 0;
+		off_t size = 0;
+		int64_t mtime_ns = 0;
+
+		bool operator==(const identity &) const = default;
+	};
+
+	static identity identity_of(const struct stat &st) {
+		return {st.st_dev, st.st_ino, st.st_size,
+				st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec};
+	}
+
+  private:
+	const uint8_t *ptr = nullptr;
+	size_t len = 0;
+	identity id;
+
+  public:
+	mapped_file() = default;
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+	~mapped_file() {
+		if (ptr)
+			munmap(const_cast<uint8_t *>(ptr), len);
+	}
+
+	// empty if path can't be mapped
+	static std::shared_ptr<const mapped_file> open(const std::string &path) {
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return nullptr;
+
+		auto file = std::make_shared<mapped_file>();
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			file->id = identity_of(st);
+			void *map =
+				mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED) {
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+				file->ptr = static_cast<const uint8_t *>(map);
+				file->len = st.st_size;
+			}
+		}
+		close(fd);
+		return file->ptr ? file : nullptr;
+	}
+
+	const uint8_t *data() const { return ptr; }
+	size_t size() const { return len; }
+	const identity &file_identity() const { return id; }
+};
+
+using shared_mapping = std::shared_ptr<const mapped_file>;
+
+// the most recently used mappings by path, so the size probe and the decode
+// of a file, and decodes after the decode cache dropped it, map it once.
+// A file replaced or rewritten since it was mapped is mapped again, jobs
+// still holding the old mapping keep it
+class mapping_cache {
+  private:
+	struct entry {
+		shared_mapping file;
+		uint64_t last_use = 0;
+	};
+
+	std::unordered_map<std::string, entry> entries;
+	size_t max_entries = 64;
+	uint64_t tick = 0;
+	std::mutex mutex;
+
+  public:
+	void set_max_entries(size_t n) {
+		std::scoped_lock lk(mutex);
+		max_entries = n;
+	}
+
+	shared_mapping get(const std::string &path) {
+		struct stat st;
+		if (stat(path.c_str(), &st) == -1)
+			return nullptr;
+
+		std::unique_lock lk(mutex);
+		auto it = entries.find(path);
+		if (it != entries.end()) {
+			if (it->second.file->file_identity() ==
+				mapped_file::identity_of(st)) {
+				it->second.last_use = tick++;
+				return it->second.file;
+			}
+			entries.erase(it);
+		}
+		lk.unlock();
+
+		shared_mapping file = mapped_file::open(path);
+		if (!file || max_entries == 0)
+			return file;
+
+		lk.lock();
+		while (entries.size() >= max_entries) {
+			auto lru = entries.begin();
+			for (auto it = entries.begin(); it != entries.end(); ++it)
+				if (it->second.last_use < lru->second.last_use)
+					lru = it;
+			entries.erase(lru);
+		}
+		entries[path] = {file, tick++};
+		return file;
+	}
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glm/glm.hpp>
+
+// what was learned about an image file, zero or -1 where nothing was yet
+struct image_metadata {
+	glm::ivec2 size{0, 0};
+	int image_type = -1;
+	uint32_t decode_us = 0; // of the last full size decode
+};
+
+// $XDG_CACHE_HOME/image_viewer/metadata or ~/.cache/image_viewer/metadata,
+// empty if there is no home
+inline std::string default_metadata_path() {
+	if (const char *cache = std::getenv("XDG_CACHE_HOME"); cache && *cache)
+		return std::string(cache) + "/image_viewer/metadata";
+	if (const char *home = std::getenv("HOME"); home && *home)
+		return std::string(home) + "/.cache/image_viewer/metadata";
+	return {};
+}
+
+// image_metadata kept across runs in a memory mapped file, keyed by path,
+// file size and modification time so changed files are looked at again.
+// The file has a fixed number of slots, each path hashes to a few of them
+// and replaces one when they are all taken. Viewers running at the same
+// time share it without locking: each slot has a seqlock, so a slot being
+// written is never read, and of two viewers writing a slot at once one
+// loses its write. A viewer killed while writing leaves its slot unused
+class metadata_cache {
+  private:
+	static constexpr uint64_t magic = 0x3261746164617476; // "vtadata2"
+	static constexpr size_t probe_slots = 8;
+
+	struct file_header {
+		uint64_t magic;
+		uint64_t n_slots;
+	};
+	struct slot {
+		uint64_t sequence;	// odd while a viewer writes the slot
+		uint64_t path_hash; // 0 if free
+		uint64_t file_size;
+		int64_t mtime_ns;
+		int32_t width, height;
+		int32_t image_type;
+		uint32_t decode_us;
+	};
+
+	struct file_key {
+		uint64_t path_hash, file_size;
+		int64_t mtime_ns;
+	};
+
+	void *map = nullptr;
+	size_t map_bytes = 0;
+	slot *slots = nullptr;
+	size_t n_slots = 0;
+	std::mutex mutex;
+
+	static std::optional<file_key> key_of(const std::string &path) {
+		struct stat st;
+		if (stat(path.c_str(), &st) == -1)
+			return std::nullopt;
+
+		// FNV-1a of the absolute path
+		std::error_code ec;
+		std::string abs = std::filesystem::absolute(path, ec).string();
+		uint64_t hash = 0xcbf29ce484222325;
+		for (unsigned char c : ec ? path : abs)
+			hash = (hash ^ c) * 0x100000001b3;
+		return file_key{hash ? hash : 1, uint64_t(st.st_size),
+						st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec};
+	}
+
+	static bool matches(const slot &s, const file_key &key) {
+		return s.path_hash == key.path_hash && s.file_size == key.file_size &&
+			   s.mtime_ns == key.mtime_ns;
+	}
+
+	template <typename T> static std::atomic_ref<T> shared(T &field) {
+		return std::atomic_ref<T>(field);
+	}
+
+	// copy of s, empty if another viewer keeps writing it
+	static std::optional<slot> load(slot &s) {
+		constexpr auto relaxed = std::memory_order_relaxed;
+		for (int tries = 0; tries < 4; ++tries) {
+			uint64_t seq = shared(s.sequence).load(std::memory_order_acquire);
+			if (seq & 1)
+				continue;
+			slot copy{seq,
+					  shared(s.path_hash).load(relaxed),
+					  shared(s.file_size).load(relaxed),
+					  shared(s.mtime_ns).load(relaxed),
+					  shared(s.width).load(relaxed),
+					  shared(s.height).load(relaxed),
+					  shared(s.image_type).load(relaxed),
+					  shared(s.decode_us).load(relaxed)};
+			// the fields are read before the sequence is checked again
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (shared(s.sequence).load(relaxed) == seq)
+				return copy;
+		}
+		return std::nullopt;
+	}
+
+	// writes value to s, false if another viewer is writing it
+	static bool store(slot &s, const slot &value) {
+		constexpr auto relaxed = std::memory_order_relaxed;
+		uint64_t seq = shared(s.sequence).load(relaxed);
+		if ((seq & 1) || !shared(s.sequence).compare_exchange_strong(
+							 seq, seq + 1, std::memory_order_acquire))
+			return false;
+		// readers seeing any of the fields see the odd sequence
+		std::atomic_thread_fence(std::memory_order_release);
+		shared(s.path_hash).store(value.path_hash, relaxed);
+		shared(s.file_size).store(value.file_size, relaxed);
+		shared(s.mtime_ns).store(value.mtime_ns, relaxed);
+		shared(s.width).store(value.width, relaxed);
+		shared(s.height).store(value.height, relaxed);
+		shared(s.image_type).store(value.image_type, relaxed);
+		shared(s.decode_us).store(value.decode_us, relaxed);
+		shared(s.sequence).store(seq + 2, std::memory_order_release);
+		return true;
+	}
+
+	// the slot holding key, or if insert is set the one to hold it, and in
+	// held what it holds, which for a new slot is nothing known yet
+	slot *find(const file_key &key, bool insert, slot &held) {
+		size_t first = key.path_hash % n_slots;
+		slot *free_slot = nullptr;
+		for (size_t i = 0; i < probe_slots; ++i) {
+			slot &s = slots[(first + i) % n_slots];
+			auto copy = load(s);
+			if (!copy)
+				continue;
+			if (copy->path_hash == key.path_hash || copy->path_hash == 0) {
+				if (matches(*copy, key)) {
+					held = *copy;
+					return &s;
+				}
+				if (!free_slot)
+					free_slot = &s; // free, or an older version of the file
+			}
+		}
+		if (!insert)
+			return nullptr;
+		if (!free_slot)
+			free_slot = &slots[(first + (key.path_hash >> 32) % probe_slots) %
+							   n_slots];
+		held = {0, key.path_hash, key.file_size, key.mtime_ns, 0, 0, -1, 0};
+		return free_slot;
+	}
+
+  public:
+	metadata_cache() = default;
+	metadata_cache(const metadata_cache &) = delete;
+	~metadata_cache() {
+		if (map)
+			munmap(map, map_bytes);
+	}
+
+	// maps the cache at path, starting it over with room for n images if it
+	// doesn't exist or was made for another size. false if it can't be
+	bool open(const std::string &path, size_t n) {
+		if (path.empty() || n == 0)
+			return false;
+		std::error_code ec;
+		std::filesystem::create_directories(
+			std::filesystem::path(path).parent_path(), ec);
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1)
+			return false;
+
+		size_t bytes = sizeof(file_header) + n * sizeof(slot);
+		struct stat st;
+		bool reuse = fstat(fd, &st) == 0 && size_t(st.st_size) == bytes;
+		if (!reuse && (ftruncate(fd, 0) == -1 || ftruncate(fd, bytes) == -1)) {
+			close(fd);
+			return false;
+		}
+		void *mapped =
+			mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapped == MAP_FAILED)
+			return false;
+
+		auto header = static_cast<file_header *>(mapped);
+		if (!reuse || header->magic != magic || header->n_slots != n) {
+			std::fill_n(static_cast<char *>(mapped), bytes, 0);
+			*header = {magic, n};
+		}
+
+		std::scoped_lock lk(mutex);
+		map = mapped;
+		map_bytes = bytes;
+		slots = reinterpret_cast<slot *>(header + 1);
+		n_slots = n;
+		return true;
+	}
+
+	// empty if nothing is known about the file as it is now
+	std::optional<image_metadata> get(const std::string &path) {
+		if (!slots)
+			return std::nullopt;
+		auto key = key_of(path);
+		if (!key)
+			return std::nullopt;
+
+		std::scoped_lock lk(mutex);
+		slot held;
+		if (!find(*key, false, held))
+			return std::nullopt;
+		return image_metadata{{held.width, held.height}, held.image_type,
+							  held.decode_us};
+	}
+
+	// f(image_metadata &) changes what is kept for path
+	template <typename F> void update(const std::string &path, F &&f) {
+		if (!slots)
+			return;
+		auto key = key_of(path);
+		if (!key)
+			return;
+
+		std::scoped_lock lk(mutex);
+		slot held;
+		slot *s = find(*key, true, held);
+		image_metadata meta{{held.width, held.height}, held.image_type,
+							held.decode_us};
+		f(meta);
+		held.width = meta.size.x;
+		held.height = meta.size.y;
+		held.image_type = meta.image_type;
+		held.decode_us = meta.decode_us;
+		store(*s, held);
+	}
+};
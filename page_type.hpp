@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+// grey of the 21 outermost columns on each side of a page, summed down the
+// columns, and the variance of the outermost ones. Nothing else is read
+class page_edges {
+  public:
+	static constexpr int n_cols = 21;
+
+  private:
+	int h;
+	// per side, left to right
+	std::array<uint64_t, n_cols> sums[2]{};
+	uint64_t squares[2]{};
+
+  public:
+	// size.x must be at least n_cols
+	page_edges(const uint8_t *pixels, glm::ivec2 size) : h(size.y) {
+		int w = size.x;
+		for (int y = 0; y < h; ++y) {
+			const uint8_t *left = pixels + size_t(y) * w * 4;
+			const uint8_t *right = left + size_t(w - n_cols) * 4;
+			uint32_t grey[2][n_cols];
+			for (int i = 0; i < n_cols; ++i) {
+				const uint8_t *l = left + i * 4, *r = right + i * 4;
+				grey[0][i] = (l[0] + l[1] + l[2]) / 3;
+				grey[1][i] = (r[0] + r[1] + r[2]) / 3;
+			}
+			for (int i = 0; i < n_cols; ++i) {
+				sums[0][i] += grey[0][i];
+				sums[1][i] += grey[1][i];
+			}
+			squares[0] += grey[0][0] * grey[0][0];
+			squares[1] += grey[1][n_cols - 1] * grey[1][n_cols - 1];
+		}
+	}
+
+	// mean of (grey - m)^2 down the outermost column of side 0 (left) or 1
+	// (right), m the mean grey of the column depth columns further in. The
+	// sum wraps at 32 bits like the per pixel sum this replaced did
+	unsigned int variance(int side, int depth) const {
+		int edge = side == 0 ? 0 : n_cols - 1;
+		int col = side == 0 ? depth : n_cols - 1 - depth;
+		uint32_t mean = uint32_t(sums[side][col]) / h;
+		uint32_t accum = squares[side] - 2 * mean * sums[side][edge] +
+						 uint64_t(h) * mean * mean;
+		return accum / h;
+	}
+};
+
+// 0 for a page that can be paired, or whether it looks alone: bit 0 if
+// its left edge is blank, bit 1 if its right edge is. An edge is blank
+// when its outermost column stays close to the mean grey of each of the 20
+// columns inside it
+inline int compute_image_type(const uint8_t *pixels, glm::ivec2 size) {
+	if (size.x < page_edges::n_cols || size.y == 0)
+		return 0;
+	page_edges edges(pixels, size);
+
+	int page_type = 3;
+	unsigned int var_left = 0, var_right = 0;
+	for (int depth = 1; page_type == 3 && depth <= 20; ++depth) {
+		var_left = std::max(var_left, edges.variance(0, depth));
+		var_right = std::max(var_right, edges.variance(1, depth));
+		page_type = ((var_right < 500) << 1) | (var_left < 500);
+	}
+
+	if (page_type == 3)
+		page_type = 0;
+	return page_type;
+}
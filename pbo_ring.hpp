@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <GL/gl3w.h>
+
+// pixel unpack buffer split in fixed size slots and mapped for its whole
+// lifetime, so resize workers can write straight into memory the GL uploads
+// from. try_acquire(), data() and release() can be called from any thread,
+// the rest only with a context sharing the buffer current
+class pbo_ring {
+  private:
+	GLuint buffer = 0;
+	uint8_t *mapped = nullptr;
+	size_t slot_bytes = 0;
+
+	std::vector<int> free_slots;
+	std::vector<std::pair<int, GLsync>> retired_slots;
+
+	std::mutex mutex;
+
+  public:
+	void init(int n_slots, size_t slot_bytes) {
+		this->slot_bytes = slot_bytes;
+		size_t total_bytes = n_slots * slot_bytes;
+		GLbitfield flags =
+			GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		glCreateBuffers(1, &buffer);
+		glNamedBufferStorage(buffer, total_bytes, nullptr, flags);
+		mapped = static_cast<uint8_t *>(
+			glMapNamedBufferRange(buffer, 0, total_bytes, flags));
+
+		for (int i = 0; i < n_slots; ++i)
+			free_slots.push_back(i);
+	}
+
+	void destroy() {
+		for (auto [slot, fence] : retired_slots)
+			glDeleteSync(fence);
+		retired_slots.clear();
+
+		glUnmapNamedBuffer(buffer);
+		glDeleteBuffers(1, &buffer);
+		mapped = nullptr;
+	}
+
+	// a free slot, -1 if bytes don't fit in one or all are taken. Doesn't
+	// wait, slots are held by jobs whose resize bands may still be queued
+	// behind the caller
+	int try_acquire(size_t bytes) {
+		if (!mapped || bytes > slot_bytes)
+			return -1;
+
+		std::scoped_lock lk(mutex);
+		if (free_slots.empty())
+			return -1;
+		int slot = free_slots.back();
+		free_slots.pop_back();
+		return slot;
+	}
+
+	uint8_t *data(int slot) const { return mapped + slot * slot_bytes; }
+
+	// pixels argument for uploads while bound to GL_PIXEL_UNPACK_BUFFER
+	const void *offset(int slot) const {
+		return reinterpret_cast<const void *>(slot * slot_bytes);
+	}
+
+	GLuint id() const { return buffer; }
+
+	// for slots the GL never read from
+	void release(int slot) {
+		std::scoped_lock lk(mutex);
+		free_slots.push_back(slot);
+	}
+
+	// the slot becomes free once the commands issued so far are done
+	void retire(int slot) {
+		GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		std::scoped_lock lk(mutex);
+		retired_slots.emplace_back(slot, fence);
+	}
+
+	bool busy() {
+		std::scoped_lock lk(mutex);
+		return !retired_slots.empty();
+	}
+
+	void reclaim() {
+		std::scoped_lock lk(mutex);
+		std::erase_if(retired_slots, [this](const auto &retired) {
+			GLenum status = glClientWaitSync(retired.second,
+											 GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+			if (status != GL_ALREADY_SIGNALED &&
+				status != GL_CONDITION_SATISFIED)
+				return false;
+
+			glDeleteSync(retired.second);
+			free_slots.push_back(retired.first);
+			return true;
+		});
+	}
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <stop_token>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+// cores kept busy by other processes, averaged over the time between two
+// calls: the busy time of all CPUs from /proc/stat minus the CPU time of
+// this process over the same interval. 0 on the first call or if
+// /proc/stat can't be read
+class others_load_meter {
+  private:
+	double last_busy_s = 0.0, last_self_s = 0.0;
+	std::chrono::steady_clock::time_point last_time;
+
+	// busy time of all CPUs since boot, negative if unavailable
+	static double read_busy_s() {
+		unsigned long long user, nice, system, idle, iowait, irq, softirq,
+			steal;
+		FILE *f = fopen("/proc/stat", "r");
+		if (!f)
+			return -1.0;
+		int n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+					   &user, &nice, &system, &idle, &iowait, &irq, &softirq,
+					   &steal);
+		fclose(f);
+		if (n != 8)
+			return -1.0;
+		// guest time is already counted in user
+		double busy = user + nice + system + irq + softirq + steal;
+		return busy / sysconf(_SC_CLK_TCK);
+	}
+
+	static double read_self_s() {
+		rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) == -1)
+			return 0.0;
+		return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+			   (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+	}
+
+  public:
+	double sample() {
+		auto now = std::chrono::steady_clock::now();
+		double busy_s = read_busy_s(), self_s = read_self_s();
+		double elapsed_s =
+			std::chrono::duration<double>(now - last_time).count();
+
+		double load = 0.0;
+		if (last_time != std::chrono::steady_clock::time_point() &&
+			busy_s >= 0.0 && last_busy_s >= 0.0 && elapsed_s > 0.0) {
+			double others_s = (busy_s - last_busy_s) - (self_s - last_self_s);
+			load = std::max(others_s / elapsed_s, 0.0);
+		}
+		last_busy_s = busy_s;
+		last_self_s = self_s;
+		last_time = now;
+		return load;
+	}
+};
+
+// MemAvailable / MemTotal from /proc/meminfo, 1 if unavailable
+inline double read_available_memory() {
+	double total = 0.0, available = 0.0;
+	if (FILE *f = fopen("/proc/meminfo", "r")) {
+		char line[256];
+		while (fgets(line, sizeof(line), f)) {
+			sscanf(line, "MemTotal: %lf", &total);
+			sscanf(line, "MemAvailable: %lf", &available);
+		}
+		fclose(f);
+	}
+	return total > 0.0 ? available / total : 1.0;
+}
+
+// resident set size of this process in bytes, 0 if unavailable
+inline size_t read_rss_bytes() {
+	size_t pages = 0, resident = 0;
+	if (FILE *f = fopen("/proc/self/statm", "r")) {
+		if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// how many workers of a loader stage may take jobs, and how long their jobs
+// took since the governor last looked
+class stage_control {
+  private:
+	std::atomic<unsigned int> active = 1;
+	std::atomic<uint64_t> busy_ns = 0;
+	std::atomic<uint64_t> jobs = 0;
+	double mean_job_ns = 0.0;
+
+	std::mutex mutex;
+	std::condition_variable_any cv;
+
+  public:
+	class job_timer {
+	  private:
+		stage_control *control;
+		std::chrono::steady_clock::time_point start;
+
+	  public:
+		job_timer(stage_control *control)
+			: control(control), start(std::chrono::steady_clock::now()) {}
+		job_timer(const job_timer &) = delete;
+		~job_timer() { finish(); }
+
+		void finish() {
+			if (!control)
+				return;
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			control->busy_ns +=
+				std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+					.count();
+			control->jobs++;
+			control = nullptr;
+		}
+	};
+
+	job_timer time_job() { return job_timer(this); }
+
+	// parks workers above the active count, false once stop is requested
+	bool wait_active(unsigned int worker, std::stop_token stop) {
+		if (worker < active)
+			return !stop.stop_requested();
+
+		std::unique_lock lk(mutex);
+		return cv.wait(lk, stop, [this, worker] { return worker < active; });
+	}
+
+	void set_active(unsigned int n_workers) {
+		{
+			std::scoped_lock lk(mutex);
+			active = n_workers;
+		}
+		cv.notify_all();
+	}
+
+	unsigned int active_workers() const { return active; }
+
+	// mean job duration, taking in the jobs finished since the last call
+	double collect() {
+		double busy = busy_ns.exchange(0);
+		uint64_t n_jobs = jobs.exchange(0);
+		if (n_jobs > 0)
+			mean_job_ns = mean_job_ns == 0.0
+							  ? busy / n_jobs
+							  : 0.7 * mean_job_ns + 0.3 * busy / n_jobs;
+		return mean_job_ns;
+	}
+};